@@ -0,0 +1,102 @@
+// Measures the directive scanner's throughput with each line ending policy, along with the cost of detecting which
+// policy a file needs. Run with an optional size in MB for the generated input (default 64)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "../when_present.h"
+
+using namespace std::literals;
+
+// Generates source text that is mostly code with a sprinkling of directives, some of them continued across lines
+static std::string generate_source(std::size_t size, std::string_view newline)
+{
+    static constexpr std::string_view code[] = {
+        "    int value = compute(first, second);"sv,
+        "    if (value > limit) { return value; }"sv,
+        "// A comment that runs on for a while to make the line a typical length"sv,
+        ""sv,
+        "}"sv,
+        "static void function_name(const std::string& argument)"sv,
+    };
+
+    std::mt19937 random(42);
+    std::string result;
+    result.reserve(size + 256);
+    while (result.size() < size)
+    {
+        switch (random() % 16)
+        {
+        case 0:
+            result.append("#if defined(FEATURE_A) && \\").append(newline).append("    defined(FEATURE_B)");
+            break;
+        case 1:
+            result.append("#else");
+            break;
+        case 2:
+            result.append("#endif");
+            break;
+        case 3:
+            result.append("#define MACRO(x) ((x) + 1)");
+            break;
+        default:
+            result.append(code[random() % std::size(code)]);
+            break;
+        }
+        result.append(newline);
+    }
+
+    return result;
+}
+
+template <typename Func>
+static double best_seconds(int iterations, Func&& func)
+{
+    auto best = std::chrono::steady_clock::duration::max();
+    for (int i = 0; i < iterations; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        best = std::min(best, std::chrono::steady_clock::now() - start);
+    }
+
+    return std::chrono::duration<double>(best).count();
+}
+
+template <typename LineEndings>
+static std::size_t scan(std::string_view text)
+{
+    std::size_t directives = 0;
+    std::size_t newlines = 0;
+    scan_chunk<LineEndings>(text, [&](const directive&) { ++directives; }, [&](std::size_t) { ++newlines; });
+    return directives + newlines;
+}
+
+int main(int argc, char** argv)
+{
+#ifndef NDEBUG
+    printf("Warning: not built as Release, so these timings are not representative\n");
+#endif
+    std::size_t sizeMB = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 64;
+    constexpr int iterations = 5;
+
+    auto lf = generate_source(sizeMB * 1024 * 1024, "\n"sv);
+    auto crlf = generate_source(sizeMB * 1024 * 1024, "\r\n"sv);
+
+    volatile std::size_t result = 0;
+    auto report = [&](const char* name, const std::string& text, double seconds) {
+        printf("%-36s %8.3f ms %10.1f MB/s\n", name, seconds * 1000, text.size() / (1024.0 * 1024.0) / seconds);
+    };
+
+    report("detect '\\r\\n' (LF input)", lf, best_seconds(iterations, [&] { result = lf.find("\r\n"sv); }));
+    report("scan, LF policy (LF input)", lf, best_seconds(iterations, [&] { result = scan<lf_line_endings>(lf); }));
+    report("scan, CRLF policy (LF input)", lf, best_seconds(iterations, [&] { result = scan<crlf_line_endings>(lf); }));
+    report("scan, CRLF policy (CRLF input)", crlf,
+        best_seconds(iterations, [&] { result = scan<crlf_line_endings>(crlf); }));
+    (void)result;
+}
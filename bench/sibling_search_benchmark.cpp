@@ -0,0 +1,140 @@
+// Compares the ways of searching a list of sibling begin lines: a linear scan, a plain binary search, the binary search
+// with a vectorized final window that sorted lists use, and the Eytzinger layout that wide lists use. This is what
+// 'eytzinger_min_siblings' in main.cpp is chosen from. Each size is measured with a single list, which stays in cache,
+// and with enough copies of the list to fill 64MB, each query searching a random copy, which does not
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../sibling_search.h"
+
+template <typename Func>
+static double best_seconds(int iterations, Func&& func)
+{
+    auto best = std::chrono::steady_clock::duration::max();
+    for (int i = 0; i < iterations; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        best = std::min(best, std::chrono::steady_clock::now() - start);
+    }
+
+    return std::chrono::duration<double>(best).count();
+}
+
+static std::size_t count_less_equal_linear(const int* values, std::size_t size, int value)
+{
+    std::size_t count = 0;
+    while ((count < size) && (values[count] <= value))
+    {
+        ++count;
+    }
+
+    return count;
+}
+
+static std::size_t count_less_equal_binary(const int* values, std::size_t size, int value)
+{
+    return std::upper_bound(values, values + size, value) - values;
+}
+
+struct query
+{
+    std::size_t copy;
+    int value;
+};
+
+int main()
+{
+#ifndef NDEBUG
+    printf("Warning: not built as Release, so these timings are not representative\n");
+#endif
+    constexpr int iterations = 5;
+    constexpr std::size_t queryCount = 1000000;
+    constexpr std::size_t coldBytes = 64 * 1024 * 1024;
+    static constexpr std::size_t sizes[] = { 16, 64, 256, 512, 1024, 2048, 4096, 16384, 65536, 262144 };
+
+    std::mt19937 random(42);
+    printf("%8s %6s %10s %10s %10s %10s   (ns per search)\n", "siblings", "cache", "linear", "binary", "window",
+        "eytzinger");
+    for (auto size : sizes)
+    {
+        // Begin lines of siblings, each a handful of lines after the end of the previous one
+        std::vector<int> sorted(size);
+        int line = 0;
+        for (auto& value : sorted)
+        {
+            line += 1 + static_cast<int>(random() % 40);
+            value = line;
+        }
+
+        std::vector<eytzinger_entry> eytzinger(size);
+        fill_eytzinger([&](std::size_t i) { return sorted[i]; }, size, 0, 1, eytzinger.data());
+
+        for (bool cold : { false, true })
+        {
+            auto copies = cold ? std::max<std::size_t>(coldBytes / (size * sizeof(eytzinger_entry)), 1) : 1;
+            std::vector<int> sortedCopies;
+            std::vector<eytzinger_entry> eytzingerCopies;
+            for (std::size_t i = 0; i < copies; ++i)
+            {
+                sortedCopies.insert(sortedCopies.end(), sorted.begin(), sorted.end());
+                eytzingerCopies.insert(eytzingerCopies.end(), eytzinger.begin(), eytzinger.end());
+            }
+
+            std::vector<query> queries(queryCount);
+            for (auto& q : queries)
+            {
+                q.copy = random() % copies;
+                q.value = static_cast<int>(random() % (line + 10));
+            }
+
+            std::size_t expected = 0;
+            for (auto& q : queries)
+            {
+                expected += count_less_equal_binary(sortedCopies.data() + q.copy * size, size, q.value);
+            }
+
+            auto measure = [&](auto search, auto* values) {
+                std::size_t total = 0;
+                auto seconds = best_seconds(iterations, [&] {
+                    total = 0;
+                    for (auto& q : queries)
+                    {
+                        total += search(values + q.copy * size, size, q.value);
+                    }
+                });
+                if (total != expected)
+                {
+                    printf("Mismatch at %zu siblings\n", size);
+                }
+                return seconds * 1e9 / queries.size();
+            };
+
+            // A linear scan of the widest lists takes too long to be worth measuring
+            double linear = 0;
+            if (size <= 4096)
+            {
+                linear = measure(count_less_equal_linear, sortedCopies.data());
+            }
+            auto binary = measure(count_less_equal_binary, sortedCopies.data());
+            auto window = measure(count_less_equal, sortedCopies.data());
+            auto layout = measure(count_less_equal_eytzinger, eytzingerCopies.data());
+
+            printf("%8zu %6s ", size, cold ? "cold" : "hot");
+            if (size <= 4096)
+            {
+                printf("%10.1f ", linear);
+            }
+            else
+            {
+                printf("%10s ", "-");
+            }
+            printf("%10.1f %10.1f %10.1f\n", binary, window, layout);
+        }
+    }
+}
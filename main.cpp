@@ -1,16 +1,64 @@
 
+#include <algorithm>
 #include <cassert>
-#include <cctype>
-#include <fstream>
-#include <iostream>
+#include <cstddef>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#ifdef WHEN_PRESENT_FUZZ
+// Work done by the scanner and by queries, counted by the complexity fuzz target. See 'LLVMFuzzerTestOneInput'
+struct work_counters
+{
+    std::size_t bytes_scanned = 0;
+    std::size_t nodes_visited = 0;
+};
+
+static work_counters fuzz_work;
+
+// The scanner is also evaluated in constant expressions, where there is nothing to count into
+#define WHEN_PRESENT_COUNT_SCANNED(bytes) \
+    (__builtin_is_constant_evaluated() ? void() : void(fuzz_work.bytes_scanned += (bytes)))
+#define WHEN_PRESENT_COUNT_VISITED(nodes) (void(fuzz_work.nodes_visited += (nodes)))
+#endif
+
+#include "sibling_search.h"
+#include "when_present.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 using namespace std::literals;
 
-static void print_usage()
+// The command line helpers are unused when main.cpp is built as the fuzz target, which replaces 'main'
+[[maybe_unused]] static void print_usage()
 {
     printf(R"^-^(
 DESCRIPTION
@@ -21,91 +69,1772 @@ DESCRIPTION
 
 USAGE
 
-    when_present.exe --lines <value>... --file <path>
+    when_present.exe --lines <value>... --file <path> [--stats] [--trace <path>]
+    when_present.exe --lines-from <path> --file <path> [--stats] [--trace <path>]
+    when_present.exe --offsets <value>... --file <path> [--stats] [--trace <path>]
 
 ARGUMENTS
 
-    lines
-        The line number(s) to calculate
+    lines
+        The line number(s) to calculate
+
+    lines-from
+        Path to read line numbers to calculate from, or '-' to read from standard
+        input. Entries are separated by whitespace and are either a line number
+        or a 'file:line' pair. Pairs that name a different file are ignored;
+        paths are normalized first, so a relative and an absolute path to the
+        same file match. '--stats' reports how many entries were ignored.
+        Entries are answered in batches as they are read. Whenever the input
+        pauses, the entries read so far are answered and flushed
+
+    offsets
+        The zero-based byte offset(s) within the file to calculate. Each offset
+        is resolved to the line that contains it
+
+    file
+        Path to the file to read from, or '-' to read from standard input. Files
+        with a UTF-16 byte order mark are converted to UTF-8 before scanning
+
+    stats
+        Display statistics about the parsed file after the requirements. Where
+        supported, this includes hardware performance counters for each phase
+
+    trace
+        Path to write timing information to, in the Chrome trace event format.
+        The output can be loaded in chrome://tracing or Perfetto
+
+)^-^");
+}
+
+struct conditional_block;
+
+// The tree is allocator aware so that embedders can allocate an entire tree from a single memory resource (e.g. a
+// std::pmr::monotonic_buffer_resource) and release it all at once. Nodes and strings use the resource of the container
+// that holds them, so a tree built into a vector that uses a given resource is allocated entirely from that resource
+using tree_allocator = std::pmr::polymorphic_allocator<std::byte>;
+
+// Represents the entirety of the start of the conditional block to the '#endif'. E.g. the whole of:
+//      #if ...
+//      ...
+//      #elif ...
+//      ...
+//      #else
+//      ...
+//      #endif
+struct conditional
+{
+    using allocator_type = tree_allocator;
+
+    explicit conditional(const allocator_type& alloc = {});
+    conditional(const conditional& other, const allocator_type& alloc = {});
+    conditional(conditional&& other) noexcept = default;
+    conditional(conditional&& other, const allocator_type& alloc);
+    conditional& operator=(const conditional&) = default;
+    conditional& operator=(conditional&&) = default;
+
+    int begin_line = 0; // The location of the starting '#if((n)def)'
+    int end_line = 0; // The location of the terminating '#endif'
+
+    std::pmr::vector<conditional_block> blocks;
+};
+
+// E.g. represents something like the following:
+//      #if ...
+//      ...
+//      #endif
+// Or:
+//      #elif ...
+//      ...
+//      #elif ...
+// Or combinations of these
+struct conditional_block
+{
+    using allocator_type = tree_allocator;
+
+    explicit conditional_block(const allocator_type& alloc = {}) : nested_conditionals(alloc)
+    {
+    }
+
+    conditional_block(const conditional_block& other, const allocator_type& alloc = {}) :
+        begin_line(other.begin_line),
+        end_line(other.end_line),
+        nested_begin_offset(other.nested_begin_offset),
+        condition(other.condition),
+        nested_conditionals(other.nested_conditionals, alloc)
+    {
+    }
+
+    conditional_block(conditional_block&& other) noexcept = default;
+
+    conditional_block(conditional_block&& other, const allocator_type& alloc) :
+        begin_line(other.begin_line),
+        end_line(other.end_line),
+        nested_begin_offset(other.nested_begin_offset),
+        condition(other.condition),
+        nested_conditionals(std::move(other.nested_conditionals), alloc)
+    {
+    }
+
+    conditional_block& operator=(const conditional_block&) = default;
+    conditional_block& operator=(conditional_block&&) = default;
+
+    int begin_line = 0; // E.g. the location of the starting '#if', '#ifdef', '#else', etc.
+    int end_line = 0;   // E.g. the location of the terminating '#endif', '#else', etc.
+    std::uint32_t nested_begin_offset = 0; // Where the begin lines of 'nested_conditionals' are in the index's layout
+    std::uint32_t condition = 0; // The ID of the text of the directive in the index's condition pool
+
+    std::pmr::vector<conditional> nested_conditionals;
+};
+
+// 'conditional_block' must be complete before the vector of them can be constructed
+inline conditional::conditional(const allocator_type& alloc) : blocks(alloc)
+{
+}
+
+inline conditional::conditional(const conditional& other, const allocator_type& alloc) :
+    begin_line(other.begin_line), end_line(other.end_line), blocks(other.blocks, alloc)
+{
+}
+
+inline conditional::conditional(conditional&& other, const allocator_type& alloc) :
+    begin_line(other.begin_line), end_line(other.end_line), blocks(std::move(other.blocks), alloc)
+{
+}
+
+// The tree builder holds pointers to conditionals while their parents' vectors grow, which relies on elements being moved
+static_assert(std::is_nothrow_move_constructible_v<conditional> && std::is_nothrow_move_constructible_v<conditional_block>);
+
+// Deduplicated storage for the text of conditions. The same conditions (e.g. '#else' or '#ifdef _WIN32') appear many
+// times in a file, so each distinct string is stored once and referred to by a stable 32-bit ID
+struct condition_pool
+{
+    explicit condition_pool(const tree_allocator& alloc = {}) : text(alloc), offsets(1, 0, alloc)
+    {
+    }
+
+    std::string_view operator[](std::uint32_t id) const
+    {
+        return std::string_view(text).substr(offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    std::size_t size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    std::pmr::string text; // Every distinct condition, back to back
+    std::pmr::vector<std::uint32_t> offsets; // Where each condition begins in 'text', followed by the end of the last
+};
+
+// The byte offset of every newline in a file, used to map byte offsets to lines. Full offsets would cost eight bytes per
+// line, so only the low 32 bits of each are stored, along with where each 4GB segment of the file begins in the list
+struct newline_table
+{
+    explicit newline_table(const tree_allocator& alloc = {}) : offsets(alloc), segment_begins(alloc)
+    {
+    }
+
+    // Offsets must be added in increasing order
+    void push_back(std::size_t offset)
+    {
+        auto segment = static_cast<std::uint64_t>(offset) >> 32;
+        while (segment_begins.size() <= segment)
+        {
+            segment_begins.push_back(offsets.size());
+        }
+        offsets.push_back(static_cast<std::uint32_t>(offset));
+    }
+
+    // Adds every offset in 'other', each shifted by 'base', which must be past every offset already added
+    void append(const newline_table& other, std::size_t base)
+    {
+        for (std::size_t segment = 0; segment < other.segment_begins.size(); ++segment)
+        {
+            auto end = (segment + 1 < other.segment_begins.size()) ? other.segment_begins[segment + 1] : other.offsets.size();
+            for (auto i = other.segment_begins[segment]; i < end; ++i)
+            {
+                push_back(base + static_cast<std::size_t>((static_cast<std::uint64_t>(segment) << 32) | other.offsets[i]));
+            }
+        }
+    }
+
+    // Returns the number of newlines that come strictly before 'offset'
+    std::size_t count_before(std::size_t offset) const
+    {
+        auto segment = static_cast<std::uint64_t>(offset) >> 32;
+        if (segment >= segment_begins.size())
+        {
+            return offsets.size();
+        }
+
+        auto begin = offsets.begin() + segment_begins[segment];
+        auto end = (segment + 1 < segment_begins.size()) ? offsets.begin() + segment_begins[segment + 1] : offsets.end();
+        return std::lower_bound(begin, end, static_cast<std::uint32_t>(offset)) - offsets.begin();
+    }
+
+    std::size_t memory_usage() const
+    {
+        return offsets.capacity() * sizeof(std::uint32_t) + segment_begins.capacity() * sizeof(std::size_t);
+    }
+
+    std::pmr::vector<std::uint32_t> offsets; // The low 32 bits of each newline's offset
+    std::pmr::vector<std::size_t> segment_begins; // The index in 'offsets' of the first newline in each 4GB segment
+};
+
+// Summary information about a parsed tree
+struct tree_statistics
+{
+    std::size_t conditionals = 0;
+    std::size_t blocks = 0;
+    std::size_t max_depth = 0;
+    std::size_t bytes = 0; // Memory owned by the tree, excluding any allocator overhead
+};
+
+static void collect_statistics(const std::pmr::vector<conditional>& conditionals, tree_statistics& stats, std::size_t depth = 1)
+{
+    if (!conditionals.empty())
+    {
+        stats.max_depth = std::max(stats.max_depth, depth);
+    }
+
+    stats.conditionals += conditionals.size();
+    stats.bytes += conditionals.capacity() * sizeof(conditional);
+    for (auto& cond : conditionals)
+    {
+        stats.blocks += cond.blocks.size();
+        stats.bytes += cond.blocks.capacity() * sizeof(conditional_block);
+        for (auto& block : cond.blocks)
+        {
+            collect_statistics(block.nested_conditionals, stats, depth + 1);
+        }
+    }
+}
+
+// The phases of execution that hardware counters are collected for with '--stats'
+enum class phase
+{
+    read,
+    scan,
+    build,
+    query,
+    count,
+};
+
+static constexpr const char* phase_names[] = { "read", "scan", "build", "query" };
+
+// Hardware performance counters, where supported. Counters are inherited by threads created after they are opened, and
+// the counts of those threads are added to the totals when they exit, so worker threads are included
+struct hardware_counters
+{
+    static constexpr std::size_t count = 5;
+    static constexpr const char* names[count] = { "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses" };
+
+    // Readings are scaled to account for the counter not running the whole time, e.g. when multiplexed with others
+    struct reading
+    {
+        std::uint64_t value = 0;
+        std::uint64_t time_enabled = 0;
+        std::uint64_t time_running = 0;
+    };
+
+    int fds[count] = { -1, -1, -1, -1, -1 };
+    bool available = false;
+
+    // Accumulated counts per phase. A negative value indicates that the counter was unavailable
+    double totals[static_cast<std::size_t>(phase::count)][count] = {};
+
+    void open()
+    {
+#ifdef __linux__
+        static constexpr std::uint64_t cacheReadMiss =
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        static constexpr std::pair<std::uint32_t, std::uint64_t> configs[count] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cacheReadMiss },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cacheReadMiss },
+        };
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = configs[i].first;
+            attr.config = configs[i].second;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            available = available || (fds[i] >= 0);
+        }
+#endif
+    }
+
+    void read(reading (&readings)[count]) const
+    {
+#ifdef __linux__
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if ((fds[i] < 0) || (::read(fds[i], &readings[i], sizeof(readings[i])) != sizeof(readings[i])))
+            {
+                readings[i] = reading{};
+            }
+        }
+#else
+        (void)readings;
+#endif
+    }
+
+    void accumulate(phase which, const reading (&begin)[count], const reading (&end)[count])
+    {
+        auto& phaseTotals = totals[static_cast<std::size_t>(which)];
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (fds[i] < 0)
+            {
+                phaseTotals[i] = -1;
+                continue;
+            }
+
+            auto running = end[i].time_running - begin[i].time_running;
+            if (running == 0)
+            {
+                // The counter was never scheduled during this phase, so there is nothing to scale
+                continue;
+            }
+
+            auto enabled = end[i].time_enabled - begin[i].time_enabled;
+            phaseTotals[i] += static_cast<double>(end[i].value - begin[i].value) * enabled / running;
+        }
+    }
+
+    ~hardware_counters()
+    {
+#ifdef __linux__
+        for (auto fd : fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+#endif
+    }
+};
+
+static hardware_counters counters;
+static std::chrono::steady_clock::duration phase_durations[static_cast<std::size_t>(phase::count)] = {};
+
+// Attributes the elapsed time and hardware counter deltas over the lifetime of the object to the given phase
+struct phase_scope
+{
+    phase_scope(phase which) : which(which)
+    {
+        if (counters.available)
+        {
+            counters.read(begin);
+        }
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~phase_scope()
+    {
+        phase_durations[static_cast<std::size_t>(which)] += std::chrono::steady_clock::now() - start;
+        if (counters.available)
+        {
+            hardware_counters::reading end[hardware_counters::count];
+            counters.read(end);
+            counters.accumulate(which, begin, end);
+        }
+    }
+
+    phase_scope(const phase_scope&) = delete;
+    phase_scope& operator=(const phase_scope&) = delete;
+
+private:
+    phase which;
+    std::chrono::steady_clock::time_point start;
+    hardware_counters::reading begin[hardware_counters::count];
+};
+
+// Timing information for '--trace'. Each thread records spans into its own buffer, so no synchronization is needed
+// while recording; the buffers are only combined once all work has completed
+struct trace_event
+{
+    const char* name;
+    std::chrono::steady_clock::time_point begin;
+    std::chrono::steady_clock::time_point end;
+};
+
+struct trace_buffer
+{
+    std::string thread_name;
+    std::vector<trace_event> events;
+};
+
+static bool tracing_enabled = false;
+static std::mutex trace_buffers_lock;
+static std::deque<trace_buffer> trace_buffers;
+static thread_local trace_buffer* current_trace_buffer = nullptr;
+
+// Names the calling thread in the trace output. Must be called before the thread records any spans
+static void trace_thread(std::string name)
+{
+    if (tracing_enabled)
+    {
+        std::lock_guard<std::mutex> lock(trace_buffers_lock);
+        current_trace_buffer = &trace_buffers.emplace_back();
+        current_trace_buffer->thread_name = std::move(name);
+    }
+}
+
+// Records the lifetime of the object as a span with the given name
+struct trace_scope
+{
+    trace_scope(const char* name) : name(name)
+    {
+        if (current_trace_buffer)
+        {
+            begin = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~trace_scope()
+    {
+        if (current_trace_buffer)
+        {
+            current_trace_buffer->events.push_back(trace_event{ name, begin, std::chrono::steady_clock::now() });
+        }
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+    const char* name;
+    std::chrono::steady_clock::time_point begin;
+};
+
+static void write_json_string(FILE* file, std::string_view str)
+{
+    fputc('"', file);
+    for (auto ch : str)
+    {
+        if ((ch == '"') || (ch == '\\'))
+        {
+            fprintf(file, "\\%c", ch);
+        }
+        else if (static_cast<unsigned char>(ch) < 0x20)
+        {
+            fprintf(file, "\\u%04x", ch);
+        }
+        else
+        {
+            fputc(ch, file);
+        }
+    }
+    fputc('"', file);
+}
+
+[[maybe_unused]] static bool write_trace(const std::string& path, const std::string& filePath)
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+    {
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::time_point::max();
+    for (auto& buffer : trace_buffers)
+    {
+        for (auto& event : buffer.events)
+        {
+            start = std::min(start, event.begin);
+        }
+    }
+
+    auto toMicroseconds = [](std::chrono::steady_clock::duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":");
+    write_json_string(file, filePath);
+    fprintf(file, "}}");
+
+    int tid = 0;
+    for (auto& buffer : trace_buffers)
+    {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", tid);
+        write_json_string(file, buffer.thread_name);
+        fprintf(file, "}}");
+
+        for (auto& event : buffer.events)
+        {
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event.name, tid,
+                toMicroseconds(event.begin - start), toMicroseconds(event.end - event.begin));
+        }
+        ++tid;
+    }
+
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return (fclose(file) == 0);
+}
+
+// Selects the value of a tuning constant. The tests also build the tool with WHEN_PRESENT_STRESS_TEST defined, which
+// shrinks the thresholds so that small generated files take the chunked, threaded and wide sibling paths that are
+// otherwise only taken by large inputs
+static constexpr std::size_t tuned([[maybe_unused]] std::size_t value, [[maybe_unused]] std::size_t stressValue)
+{
+#ifdef WHEN_PRESENT_STRESS_TEST
+    return stressValue;
+#else
+    return value;
+#endif
+}
+
+// The number of threads that work is split across
+static std::size_t worker_count()
+{
+#ifdef WHEN_PRESENT_STRESS_TEST
+    return 4;
+#else
+    return std::max(std::thread::hardware_concurrency(), 1u);
+#endif
+}
+
+// Files smaller than this are scanned on the calling thread; the cost of spinning up threads would dominate otherwise
+static constexpr std::size_t parallel_scan_threshold = tuned(8 * 1024 * 1024, 1024);
+
+// The minimum amount of data each thread is given when scanning in parallel
+static constexpr std::size_t min_chunk_size = tuned(1024 * 1024, 256);
+
+// Reads the rest of 'file' a block at a time, for input that cannot be sized up front such as standard input, pipes and
+// process substitutions
+static bool read_chunked(FILE* file, std::string& contents)
+{
+    char buffer[64 * 1024];
+    while (auto size = fread(buffer, 1, sizeof(buffer), file))
+    {
+        contents.append(buffer, size);
+    }
+
+    return !ferror(file);
+}
+
+// Reads the entire file into 'contents'. A path of '-' reads from standard input
+[[maybe_unused]] static bool read_file(const std::string& path, std::string& contents)
+{
+    if (path == "-"sv)
+    {
+        return read_chunked(stdin, contents);
+    }
+
+    auto file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+
+    // Regular files are read in one go, after which anything past the reported size (e.g. in files under /proc, which
+    // report a size of zero) is read a block at a time. Paths that cannot seek (e.g. FIFOs or '/dev/stdin') are read
+    // entirely a block at a time
+    long size = -1;
+    if ((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) >= 0) && (fseek(file, 0, SEEK_SET) == 0))
+    {
+        contents.resize(static_cast<std::size_t>(size));
+        contents.resize(fread(contents.data(), 1, contents.size(), file));
+    }
+    else
+    {
+        clearerr(file);
+    }
+
+    auto result = !ferror(file) && read_chunked(file, contents);
+    fclose(file);
+    return result;
+}
+
+// Encodings that are recognised by their byte order mark. Files without one are scanned as-is, which also covers ASCII
+enum class text_encoding
+{
+    utf8,
+    utf8_bom,
+    utf16le,
+    utf16be,
+};
+
+static constexpr const char* encoding_names[] = { "UTF-8", "UTF-8 (BOM)", "UTF-16LE", "UTF-16BE" };
+
+static constexpr std::size_t bom_size(text_encoding encoding)
+{
+    switch (encoding)
+    {
+    case text_encoding::utf8_bom:
+        return 3;
+
+    case text_encoding::utf16le:
+    case text_encoding::utf16be:
+        return 2;
+
+    default:
+        return 0;
+    }
+}
+
+static text_encoding detect_encoding(std::string_view text)
+{
+    if (text.substr(0, 3) == "\xEF\xBB\xBF"sv)
+    {
+        return text_encoding::utf8_bom;
+    }
+    else if (text.substr(0, 2) == "\xFF\xFE"sv)
+    {
+        return text_encoding::utf16le;
+    }
+    else if (text.substr(0, 2) == "\xFE\xFF"sv)
+    {
+        return text_encoding::utf16be;
+    }
+
+    return text_encoding::utf8;
+}
+
+// Byte order policies for decoding UTF-16
+struct utf16le_units
+{
+    static constexpr bool big_endian = false;
+
+    static std::uint32_t unit(const char* ptr)
+    {
+        return static_cast<unsigned char>(ptr[0]) | (static_cast<unsigned char>(ptr[1]) << 8);
+    }
+};
+
+struct utf16be_units
+{
+    static constexpr bool big_endian = true;
+
+    static std::uint32_t unit(const char* ptr)
+    {
+        return (static_cast<unsigned char>(ptr[0]) << 8) | static_cast<unsigned char>(ptr[1]);
+    }
+};
+
+// Decodes the code point at 'pos', returning the number of bytes consumed. Unpaired surrogates and a trailing odd byte
+// decode as U+FFFD
+template <typename Units>
+static std::size_t decode_utf16(std::string_view input, std::size_t pos, std::uint32_t& codePoint)
+{
+    if (input.size() - pos < 2)
+    {
+        codePoint = 0xFFFD;
+        return input.size() - pos;
+    }
+
+    codePoint = Units::unit(input.data() + pos);
+    if ((codePoint & 0xFC00) == 0xD800)
+    {
+        if (input.size() - pos >= 4)
+        {
+            auto low = Units::unit(input.data() + pos + 2);
+            if ((low & 0xFC00) == 0xDC00)
+            {
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                return 4;
+            }
+        }
+        codePoint = 0xFFFD;
+    }
+    else if ((codePoint & 0xFC00) == 0xDC00)
+    {
+        codePoint = 0xFFFD;
+    }
+
+    return 2;
+}
+
+static constexpr std::size_t utf8_length(std::uint32_t codePoint)
+{
+    return (codePoint < 0x80) ? 1 : (codePoint < 0x800) ? 2 : (codePoint < 0x10000) ? 3 : 4;
+}
+
+static void append_utf8(std::uint32_t codePoint, std::string& output)
+{
+    if (codePoint < 0x80)
+    {
+        output.push_back(static_cast<char>(codePoint));
+    }
+    else if (codePoint < 0x800)
+    {
+        output.push_back(static_cast<char>(0xC0 | (codePoint >> 6)));
+        output.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+    else if (codePoint < 0x10000)
+    {
+        output.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+        output.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+    else
+    {
+        output.push_back(static_cast<char>(0xF0 | (codePoint >> 18)));
+        output.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+}
+
+// Transcodes UTF-16 (without its byte order mark) to UTF-8. Source is overwhelmingly ASCII, so runs of ASCII are
+// narrowed eight code units at a time where SSE2 is available
+template <typename Units>
+static void transcode_utf16(std::string_view input, std::string& output)
+{
+    output.clear();
+    output.reserve(input.size() / 2);
+
+    std::size_t pos = 0;
+#ifdef WHEN_PRESENT_SSE2
+    const auto nonAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+    char narrowed[16];
+    while (input.size() - pos >= 16)
+    {
+        auto units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input.data() + pos));
+        if constexpr (Units::big_endian)
+        {
+            units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+        }
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, nonAscii), _mm_setzero_si128())) == 0xFFFF)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(narrowed), _mm_packus_epi16(units, units));
+            output.append(narrowed, 8);
+            pos += 16;
+            continue;
+        }
+
+        // Fall back to decoding a single code point, then resume the fast path
+        std::uint32_t codePoint;
+        pos += decode_utf16<Units>(input, pos, codePoint);
+        append_utf8(codePoint, output);
+    }
+#endif
+
+    while (pos < input.size())
+    {
+        std::uint32_t codePoint;
+        pos += decode_utf16<Units>(input, pos, codePoint);
+        append_utf8(codePoint, output);
+    }
+}
+
+// Converts byte offsets into UTF-16 input (without its byte order mark) into offsets within the transcoded UTF-8. An
+// offset within a code point resolves to the start of that code point
+template <typename Units>
+static void map_utf16_offsets(std::string_view input, std::vector<std::size_t>& offsets)
+{
+    // Offsets are resolved in increasing order so that the input is only decoded once
+    std::vector<std::pair<std::size_t, std::size_t>> order;
+    order.reserve(offsets.size());
+    for (std::size_t i = 0; i < offsets.size(); ++i)
+    {
+        order.emplace_back(offsets[i], i);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::size_t pos = 0;
+    std::size_t utf8Pos = 0;
+    for (auto [offset, index] : order)
+    {
+        while (pos < offset)
+        {
+            std::uint32_t codePoint;
+            auto size = decode_utf16<Units>(input, pos, codePoint);
+            if (pos + size > offset)
+            {
+                break;
+            }
+            pos += size;
+            utf8Pos += utf8_length(codePoint);
+        }
+        offsets[index] = utf8Pos;
+    }
+}
+
+// Converts 'contents' to UTF-8 without a byte order mark so that the scanner only ever sees UTF-8. 'offsets' are byte
+// offsets into the original contents and are updated to refer to the same positions in the converted text
+static text_encoding decode_input(std::string& contents, std::vector<std::size_t>& offsets)
+{
+    auto encoding = detect_encoding(contents);
+    auto bomSize = bom_size(encoding);
+    for (auto& offset : offsets)
+    {
+        offset = (offset < bomSize) ? 0 : (offset - bomSize);
+    }
+
+    auto input = std::string_view(contents).substr(bomSize);
+    if (encoding == text_encoding::utf8_bom)
+    {
+        contents.erase(0, bomSize);
+    }
+    else if (encoding == text_encoding::utf16le)
+    {
+        std::string output;
+        transcode_utf16<utf16le_units>(input, output);
+        map_utf16_offsets<utf16le_units>(input, offsets);
+        contents = std::move(output);
+    }
+    else if (encoding == text_encoding::utf16be)
+    {
+        std::string output;
+        transcode_utf16<utf16be_units>(input, output);
+        map_utf16_offsets<utf16be_units>(input, offsets);
+        contents = std::move(output);
+    }
+
+    return encoding;
+}
+
+// Finds all conditional directives in the file. Large files are split into chunks at line boundaries and each chunk is
+// scanned on its own thread. Since the scan has no state that spans lines other than continuations, the only
+// requirement on chunk boundaries is that they not split a continued line. If 'newlines' is non-null, the offset of every
+// newline character in the file is recorded in it as well
+template <typename LineEndings>
+static std::vector<directive> scan_chunks(std::string_view text, newline_table* newlines)
+{
+    std::size_t chunkCount = 1;
+    if (text.size() >= parallel_scan_threshold)
+    {
+        chunkCount = std::clamp<std::size_t>(worker_count(), 1, text.size() / min_chunk_size);
+    }
+
+    std::vector<std::string_view> chunks;
+    std::size_t chunkBegin = 0;
+    for (std::size_t i = 1; i < chunkCount; ++i)
+    {
+        auto pos = std::max(chunkBegin, text.size() * i / chunkCount);
+        while ((pos = text.find('\n', pos)) != text.npos)
+        {
+            if (!is_line_continuation<LineEndings>(text, pos++))
+            {
+                break;
+            }
+        }
+
+        if (pos == text.npos)
+        {
+            break;
+        }
+
+        chunks.push_back(text.substr(chunkBegin, pos - chunkBegin));
+        chunkBegin = pos;
+    }
+    chunks.push_back(text.substr(chunkBegin));
+
+    std::vector<std::vector<directive>> chunkDirectives(chunks.size());
+    std::vector<newline_table> chunkNewlines(newlines ? chunks.size() : 0);
+    std::vector<int> chunkLineCounts(chunks.size());
+    auto scan = [&](std::size_t i) {
+        trace_scope trace("scan chunk");
+        chunkLineCounts[i] = scan_chunk<LineEndings>(
+            chunks[i],
+            [&](const directive& dir) {
+                // Only directives that affect the tree need to be kept
+                if (role_of(dir.kind) != conditional_role::none)
+                {
+                    chunkDirectives[i].push_back(dir);
+                }
+            },
+            [&](std::size_t pos) {
+                if (newlines)
+                {
+                    chunkNewlines[i].push_back(pos);
+                }
+            });
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < chunks.size(); ++i)
+    {
+        threads.emplace_back([&, i] {
+            trace_thread("scan worker " + std::to_string(i));
+            scan(i);
+        });
+    }
+    scan(0);
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Newline positions are relative to the start of each chunk
+    if (newlines && (chunks.size() == 1))
+    {
+        *newlines = std::move(chunkNewlines[0]);
+    }
+    else if (newlines)
+    {
+        newlines->offsets.clear();
+        newlines->segment_begins.clear();
+        for (std::size_t i = 0; i < chunks.size(); ++i)
+        {
+            newlines->append(chunkNewlines[i], static_cast<std::size_t>(chunks[i].data() - text.data()));
+        }
+    }
+
+    if (chunkDirectives.size() == 1)
+    {
+        return std::move(chunkDirectives[0]);
+    }
+
+    // Each chunk numbers its lines starting from 1, so offset each by the number of lines in all chunks that precede it
+    std::size_t directiveCount = 0;
+    for (auto& list : chunkDirectives)
+    {
+        directiveCount += list.size();
+    }
+
+    std::vector<directive> result;
+    result.reserve(directiveCount);
+    int lineOffset = 0;
+    for (std::size_t i = 0; i < chunks.size(); ++i)
+    {
+        for (auto& dir : chunkDirectives[i])
+        {
+            dir.line += lineOffset;
+            result.push_back(dir);
+        }
+        lineOffset += chunkLineCounts[i];
+    }
+
+    return result;
+}
+
+// Finds all conditional directives in the file. Each line is checked for a '\r' before its newline on its own, since a
+// file can mix line endings (e.g. a CRLF file edited with an LF editor). The check costs nothing measurable next to the
+// search for the newline itself; see bench/scan_benchmark.cpp
+static std::vector<directive> scan_directives(std::string_view text, newline_table* newlines = nullptr)
+{
+    return scan_chunks<crlf_line_endings>(text, newlines);
+}
+
+// Links the flat list of directives together into a tree that describes preprocessor requirements. The tree is allocated
+// using the memory resource of 'conditionals'. The text of each condition is added to 'conditions'
+static bool build_tree(
+    const std::vector<directive>& directives, std::pmr::vector<conditional>& conditionals, condition_pool& conditions)
+{
+    // Directive text refers to the file contents, which outlive the build, so the text can be used as the key
+    std::unordered_map<std::string_view, std::uint32_t> conditionIds;
+    auto intern = [&](std::string_view text) {
+        auto [itr, inserted] = conditionIds.emplace(text, static_cast<std::uint32_t>(conditions.size()));
+        if (inserted)
+        {
+            conditions.text.append(text);
+            conditions.offsets.push_back(static_cast<std::uint32_t>(conditions.text.size()));
+        }
+        return itr->second;
+    };
+
+    std::vector<conditional*> stateStack;
+    for (auto& dir : directives)
+    {
+        auto role = role_of(dir.kind);
+        if (role == conditional_role::begin)
+        {
+            // This is the start of a new, possibly nested, conditional
+            if (stateStack.empty())
+            {
+                // This is "top level"
+                conditionals.emplace_back();
+                stateStack.push_back(&conditionals.back());
+            }
+            else
+            {
+                // Nested inside of another conditional block
+                auto& currentBlock = stateStack.back()->blocks.back();
+                currentBlock.nested_conditionals.emplace_back();
+                stateStack.push_back(&currentBlock.nested_conditionals.back());
+            }
+
+            auto& cond = *stateStack.back();
+            assert(cond.blocks.empty());
+            cond.begin_line = dir.line;
+            cond.blocks.emplace_back();
+            cond.blocks.back().begin_line = dir.line;
+            cond.blocks.back().condition = intern(dir.text);
+        }
+        else if (role == conditional_role::alternative)
+        {
+            if (stateStack.empty())
+            {
+                printf("ERROR: Encountered else outside of a conditional\n");
+                return false;
+            }
+
+            auto& cond = *stateStack.back();
+            assert(!cond.blocks.empty());
+            cond.blocks.back().end_line = dir.line;
+
+            cond.blocks.emplace_back();
+            cond.blocks.back().begin_line = dir.line;
+            cond.blocks.back().condition = intern(dir.text);
+        }
+        else
+        {
+            // End of the current conditional
+            if (stateStack.empty())
+            {
+                printf("ERROR: Encountered '#endif' with no matching conditional\n");
+                return false;
+            }
+
+            auto& cond = *stateStack.back();
+            assert(!cond.blocks.empty());
+            cond.end_line = dir.line;
+            cond.blocks.back().end_line = dir.line;
+            stateStack.pop_back();
+        }
+    }
+
+    if (!stateStack.empty())
+    {
+        printf("ERROR: Reached end of file with an active conditional block\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Sibling lists at least this wide are searched using an Eytzinger (breadth first) layout rather than a sorted array. A
+// binary search over a wide sorted array touches a new cache line at nearly every step, whereas the top levels of an
+// Eytzinger layout share cache lines and the next few levels can be prefetched. Below about this size the sorted array's
+// vectorized final window wins when the list is not in cache; see bench/sibling_search_benchmark.cpp, which must be built
+// as Release for its timings to mean anything
+static constexpr std::size_t eytzinger_min_siblings = tuned(1024, 8);
+
+// The arrays used to search lists of sibling conditionals. Each list's begin lines are stored contiguously so that a
+// search does not need to touch the conditionals themselves. Lists narrower than 'eytzinger_min_siblings' are stored in
+// sorted order in 'begin_lines'; wider lists are stored in Eytzinger order in 'eytzinger_begin_lines'
+struct sibling_layout
+{
+    const int* begin_lines;
+    const eytzinger_entry* eytzinger_begin_lines;
+};
+
+// Finds the requirements for 'line' given a list of sibling conditionals whose begin lines are at 'offset' in the
+// appropriate array of 'layout'
+static void find_requirements(int line, const std::pmr::vector<conditional>& conditionals, std::uint32_t offset,
+    const sibling_layout& layout, const condition_pool& conditions, std::pmr::vector<requirement>& result)
+{
+    // Sibling conditionals are sorted and do not overlap, so the only one that can contain the line is the last one that
+    // begins at or before it. Generated files can have thousands of siblings, so search the contiguous begin lines
+    // rather than the conditionals themselves
+    auto count = (conditionals.size() >= eytzinger_min_siblings) ?
+        count_less_equal_eytzinger(layout.eytzinger_begin_lines + offset, conditionals.size(), line) :
+        count_less_equal(layout.begin_lines + offset, conditionals.size(), line);
+    if (count == 0)
+    {
+        return;
+    }
+
+    auto& cond = conditionals[count - 1];
+    if (cond.end_line < line)
+    {
+        return;
+    }
+
+    // Figure out which block it's in
+    for (auto& block : cond.blocks)
+    {
+        WHEN_PRESENT_COUNT_VISITED(1);
+        if (block.begin_line <= line && block.end_line > line)
+        {
+            result.push_back(requirement{ true, block.begin_line, conditions[block.condition] });
+            find_requirements(line, block.nested_conditionals, block.nested_begin_offset, layout, conditions, result);
+
+            // Ignore later blocks as they don't affect definition
+            break;
+        }
+        else
+        {
+            // Otherwise the condition must be false. This is still relevant!
+            result.push_back(requirement{ false, block.begin_line, conditions[block.condition] });
+        }
+    }
+}
+
+// A fully parsed file. Indexes are only ever handed out as 'std::shared_ptr<const conditional_index>' and are never
+// modified once built, so a single index can be shared and queried by any number of threads at once without locking
+struct conditional_index
+{
+    explicit conditional_index(const tree_allocator& alloc = {}) :
+        conditionals(alloc),
+        conditions(alloc),
+        sibling_begin_lines(alloc),
+        eytzinger_begin_lines(alloc),
+        newlines(alloc),
+        line_states(alloc),
+        line_table(alloc)
+    {
+    }
+
+    // The line states point into the tree, so the index cannot be copied or moved without leaving them pointing into
+    // the original
+    conditional_index(const conditional_index&) = delete;
+    conditional_index& operator=(const conditional_index&) = delete;
+
+    // Appends the requirements for 'line' to be present to 'result', outermost first. The result uses whatever memory
+    // resource the caller gave it, so a host answering many queries can serve them from its own arena
+    void query(int line, std::pmr::vector<requirement>& result) const
+    {
+        // Line numbers start at 1, so there is nothing that lines before that could depend on
+        if (line <= 0)
+        {
+            return;
+        }
+
+        if (line_table.empty())
+        {
+            // The top level list is always the first in its array
+            sibling_layout layout{ sibling_begin_lines.data(), eytzinger_begin_lines.data() };
+            find_requirements(line, conditionals, 0, layout, conditions, result);
+            return;
+        }
+
+        if (static_cast<std::size_t>(line) > line_table.size())
+        {
+            return;
+        }
+
+        // States are visited innermost first, so each conditional's requirements are added in reverse and the whole
+        // list is flipped at the end
+        auto first = result.size();
+        for (auto state = line_table[line - 1]; state != 0; state = line_states[state - 1].parent)
+        {
+            auto& current = line_states[state - 1];
+            auto& blocks = current.owner->blocks;
+            WHEN_PRESENT_COUNT_VISITED(1 + current.block);
+            if (current.block < blocks.size())
+            {
+                result.push_back(requirement{ true, blocks[current.block].begin_line, conditions[blocks[current.block].condition] });
+            }
+
+            for (auto i = current.block; i-- > 0;)
+            {
+                result.push_back(requirement{ false, blocks[i].begin_line, conditions[blocks[i].condition] });
+            }
+        }
+        std::reverse(result.begin() + first, result.end());
+    }
+
+    // Returns the line that contains the given byte offset. Only valid if the index was built with newline offsets
+    int line_from_offset(std::size_t offset) const
+    {
+        // A newline belongs to the line it terminates, so the line number is one more than the count of newlines that
+        // come strictly before the offset
+        return static_cast<int>(newlines.count_before(offset)) + 1;
+    }
+
+    // Where a line sits in the tree: the innermost conditional that encloses it and the block of that conditional that
+    // contains the line. A 'block' equal to the number of blocks means the line is the '#endif', which no block contains
+    struct line_state
+    {
+        const conditional* owner;
+        std::uint32_t block;
+        std::uint32_t parent; // One plus the index of the state of the enclosing block, or zero if 'owner' is top level
+    };
+
+    std::pmr::vector<conditional> conditionals;
+    condition_pool conditions;
+
+    // The begin lines of every list of sibling conditionals. See 'sibling_layout' for details
+    std::pmr::vector<int> sibling_begin_lines;
+    std::pmr::vector<eytzinger_entry> eytzinger_begin_lines;
+
+    newline_table newlines; // Empty unless byte offsets are needed
+
+    // Optional dense lookup table that gives the state of every line in constant time, rather than searching the tree.
+    // Each entry is one plus the index of the line's state, or zero if the line is not inside any conditional
+    std::pmr::vector<line_state> line_states;
+    std::pmr::vector<std::uint32_t> line_table;
+};
+
+// The dense lookup table costs memory for every line up to the last '#endif', so it is only built when enough queries are
+// expected to pay for building it, and only for files small enough that the table stays a reasonable size
+static constexpr std::size_t dense_table_lines_per_query = 64;
+static constexpr std::size_t dense_table_max_lines = 16 * 1024 * 1024;
+
+// Fills in the dense lookup table for the lines of 'cond'. Each line is written exactly once: lines of a block that fall
+// inside a nested conditional are filled in by that conditional instead
+static void fill_line_table(conditional_index& index, const conditional& cond, std::uint32_t parent)
+{
+    auto fill = [&](int firstLine, int endLine, std::uint32_t state) {
+        std::fill(index.line_table.begin() + (firstLine - 1), index.line_table.begin() + (endLine - 1), state);
+    };
+
+    for (std::size_t i = 0; i < cond.blocks.size(); ++i)
+    {
+        auto& block = cond.blocks[i];
+        index.line_states.push_back(conditional_index::line_state{ &cond, static_cast<std::uint32_t>(i), parent });
+        auto state = static_cast<std::uint32_t>(index.line_states.size());
+
+        auto line = block.begin_line;
+        for (auto& nested : block.nested_conditionals)
+        {
+            fill(line, nested.begin_line, state);
+            fill_line_table(index, nested, state);
+            line = nested.end_line + 1;
+        }
+        fill(line, block.end_line, state);
+    }
+
+    index.line_states.push_back(
+        conditional_index::line_state{ &cond, static_cast<std::uint32_t>(cond.blocks.size()), parent });
+    index.line_table[cond.end_line - 1] = static_cast<std::uint32_t>(index.line_states.size());
+}
+
+// Appends the begin lines of 'conditionals' to the appropriate search array of the index, followed by those of each
+// nested list, recording where each nested list starts. Returns the offset of 'conditionals' in its array
+static std::uint32_t build_sibling_layout(conditional_index& index, std::pmr::vector<conditional>& conditionals)
+{
+    std::uint32_t offset;
+    if (conditionals.size() >= eytzinger_min_siblings)
+    {
+        offset = static_cast<std::uint32_t>(index.eytzinger_begin_lines.size());
+        index.eytzinger_begin_lines.resize(offset + conditionals.size());
+        fill_eytzinger([&](std::size_t i) { return conditionals[i].begin_line; }, conditionals.size(), 0, 1,
+            index.eytzinger_begin_lines.data() + offset);
+    }
+    else
+    {
+        offset = static_cast<std::uint32_t>(index.sibling_begin_lines.size());
+        for (auto& cond : conditionals)
+        {
+            index.sibling_begin_lines.push_back(cond.begin_line);
+        }
+    }
+
+    for (auto& cond : conditionals)
+    {
+        for (auto& block : cond.blocks)
+        {
+            block.nested_begin_offset = build_sibling_layout(index, block.nested_conditionals);
+        }
+    }
+
+    return offset;
+}
+
+// Builds an index from the directives in a file, allocating it from 'alloc'. The number of queries expected to be made
+// against the index determines whether or not the dense lookup table is built. Returns null if the directives do not
+// form a valid tree, in which case the error has already been displayed
+static std::shared_ptr<const conditional_index> build_index(const std::vector<directive>& directives,
+    newline_table newlines = newline_table(), std::size_t expectedQueries = 0, const tree_allocator& alloc = {})
+{
+    auto index = std::allocate_shared<conditional_index>(std::pmr::polymorphic_allocator<conditional_index>(alloc), alloc);
+    if (!build_tree(directives, index->conditionals, index->conditions))
+    {
+        return nullptr;
+    }
+
+    index->newlines = std::move(newlines);
+    build_sibling_layout(*index, index->conditionals);
+
+    // The tree is complete and is never modified again, so pointers into it remain valid
+    auto tableLines = index->conditionals.empty() ? 0 : static_cast<std::size_t>(index->conditionals.back().end_line);
+    if ((tableLines > 0) && (tableLines <= dense_table_max_lines) &&
+        (expectedQueries >= tableLines / dense_table_lines_per_query))
+    {
+        index->line_table.resize(tableLines);
+        for (auto& cond : index->conditionals)
+        {
+            fill_line_table(*index, cond, 0);
+        }
+    }
+
+    return index;
+}
+
+// Queries are answered in batches so that the output for a huge set of queries is never held in memory all at once
+static constexpr std::size_t query_batch_size = tuned(64 * 1024, 1000);
+
+// The minimum number of queries each thread is given when answering a batch in parallel
+static constexpr std::size_t min_queries_per_thread = tuned(4 * 1024, 100);
+
+static void format_requirements(const std::pmr::vector<requirement>& requirements, std::string& output)
+{
+    char buffer[64];
+    for (auto& req : requirements)
+    {
+        output.append(buffer,
+            snprintf(buffer, sizeof(buffer), req.value ? "REQUIRES TRUE (%4d):  " : "REQUIRES FALSE (%4d): ", req.line));
+        output.append(req.condition);
+        output.push_back('\n');
+    }
+    output.push_back('\n');
+}
+
+// Answers the queries in the range [begin, end), appending the formatted results to 'output'
+static void format_queries(const conditional_index& index, const int* begin, const int* end, std::string& output)
+{
+    std::pmr::vector<requirement> requirements;
+    char buffer[128];
+    for (; begin != end; ++begin)
+    {
+        requirements.clear();
+        index.query(*begin, requirements);
+
+        output.append(buffer,
+            snprintf(buffer, sizeof(buffer), "Requirements for line %d being included in the translation unit:\n", *begin));
+        format_requirements(requirements, output);
+    }
+}
+
+// Answers all queries in 'lines', writing the results to stdout in order. Large batches are split across threads, each
+// of which formats its share of the batch into its own buffer. The buffers are then written out in order
+static void answer_queries(const std::shared_ptr<const conditional_index>& index, const std::vector<int>& lines)
+{
+    std::vector<std::string> outputs;
+    for (std::size_t batchBegin = 0; batchBegin < lines.size(); batchBegin += query_batch_size)
+    {
+        auto batchSize = std::min(query_batch_size, lines.size() - batchBegin);
+        auto threadCount = std::max<std::size_t>(
+            std::min<std::size_t>(worker_count(), batchSize / min_queries_per_thread), 1);
+        auto batch = lines.data() + batchBegin;
+        outputs.resize(threadCount);
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < threadCount; ++i)
+        {
+            threads.emplace_back([&, i] {
+                trace_thread("query worker " + std::to_string(i));
+                trace_scope trace("evaluate");
+                outputs[i].clear();
+                format_queries(*index, batch + batchSize * i / threadCount, batch + batchSize * (i + 1) / threadCount, outputs[i]);
+            });
+        }
+
+        {
+            trace_scope trace("evaluate");
+            outputs[0].clear();
+            format_queries(*index, batch, batch + batchSize / threadCount, outputs[0]);
+        }
 
-    file
-        Path to the file to read from
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
 
-)^-^");
+        trace_scope trace("output");
+        for (auto& output : outputs)
+        {
+            fwrite(output.data(), 1, output.size(), stdout);
+        }
+    }
 }
 
-struct conditional_block;
+// Returns whether 'ch' separates entries in a '--lines-from' file
+static constexpr bool is_entry_separator(char ch)
+{
+    return (ch == ' ') || ((ch >= '\t') && (ch <= '\r'));
+}
 
-// Represents the entirety of the start of the conditional block to the '#endif'. E.g. the whole of:
-//      #if ...
-//      ...
-//      #elif ...
-//      ...
-//      #else
-//      ...
-//      #endif
-struct conditional
+// Reads the entries of a '--lines-from' file or pipe in batches. The input is read with the operating system's own
+// reads, which return whatever is available rather than waiting for a full buffer, so that a tool writing queries one
+// at a time and waiting on each answer is answered as soon as it stops writing
+struct query_stream
 {
-    int begin_line; // The location of the starting '#if((n)def)'
-    int end_line; // The location of the terminating '#endif'
+    enum class read_status
+    {
+        more,    // The batch is full or the input has stalled; there may be more to read
+        end,     // The input has ended
+        invalid, // An entry is not a valid line number; see 'invalid_entry'
+        failed,  // The input could not be read
+    };
 
-    std::vector<std::unique_ptr<conditional_block>> blocks;
-};
+    query_stream() = default;
+    query_stream(const query_stream&) = delete;
+    query_stream& operator=(const query_stream&) = delete;
 
-// E.g. represents something like the following:
-//      #if ...
-//      ...
-//      #endif
-// Or:
-//      #elif ...
-//      ...
-//      #elif ...
-// Or combinations of these
-struct conditional_block
-{
-    int begin_line; // E.g. the location of the starting '#if', '#ifdef', '#else', etc.
-    int end_line;   // E.g. the location of the terminating '#endif', '#else', etc.
-    std::string condition;
+    ~query_stream()
+    {
+        if (owns_fd)
+        {
+#ifdef _WIN32
+            _close(fd);
+#else
+            close(fd);
+#endif
+        }
+    }
 
-    std::vector<conditional> nested_conditionals;
-};
+    // Opens 'path', or standard input if it is '-'. Entries that name a file other than 'filePath' are skipped. Paths in
+    // entries are compared after normalizing them, so e.g. an absolute path names the same file as a relative one
+    bool open(const std::string& path, std::string_view filePath)
+    {
+        file_path = filePath;
+        if (filePath != "-"sv)
+        {
+            std::error_code error;
+            canonical_file_path = std::filesystem::weakly_canonical(std::filesystem::path(filePath), error);
+        }
+        if (path == "-"sv)
+        {
+#ifdef _WIN32
+            fd = _fileno(stdin);
+            _setmode(fd, _O_BINARY);
+#else
+            fd = STDIN_FILENO;
+#endif
+            return true;
+        }
 
-static constexpr const char whitespace[] = " \t\v";
+#ifdef _WIN32
+        fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+#endif
+        owns_fd = (fd >= 0);
+        return owns_fd;
+    }
 
-static void process_line(int line, const std::vector<conditional>& conditionals)
-{
-    for (auto& cond : conditionals)
+    // Appends line numbers to 'batch' until it holds 'query_batch_size' lines, the input ends, or reading further would
+    // mean waiting for the writer while 'batch' holds lines that could be answered. On 'invalid', 'batch' holds the
+    // valid entries that preceded the invalid one
+    read_status read_batch(std::vector<int>& batch)
     {
-        if (cond.begin_line <= line && cond.end_line >= line)
+        for (;;)
         {
-            // Figure out which block it's in
-            for (auto& block : cond.blocks)
+            while (buffer_begin < buffer_end)
             {
-                if (block->begin_line <= line && block->end_line > line)
+                if (batch.size() == query_batch_size)
+                {
+                    return read_status::more;
+                }
+
+                // An entry left over from the previous read continues at the start of the buffer
+                if (partial.empty())
                 {
-                    printf("REQUIRES TRUE (%4d):  %s\n", block->begin_line, block->condition.c_str());
-                    process_line(line, block->nested_conditionals);
+                    while ((buffer_begin < buffer_end) && is_entry_separator(buffer[buffer_begin]))
+                    {
+                        ++buffer_begin;
+                    }
+                }
+
+                auto entryEnd = buffer_begin;
+                while ((entryEnd < buffer_end) && !is_entry_separator(buffer[entryEnd]))
+                {
+                    ++entryEnd;
+                }
 
-                    // Ignore later blocks as they don't affect definition
+                if (entryEnd == buffer_end)
+                {
+                    partial.append(buffer + buffer_begin, entryEnd - buffer_begin);
+                    buffer_begin = buffer_end;
                     break;
                 }
-                else
+
+                std::string_view entry(buffer + buffer_begin, entryEnd - buffer_begin);
+                buffer_begin = entryEnd;
+                if (!partial.empty())
+                {
+                    partial.append(entry);
+                    entry = partial;
+                }
+
+                auto valid = add_entry(entry, batch);
+                partial.clear();
+                if (!valid)
+                {
+                    return read_status::invalid;
+                }
+            }
+
+            if (at_end)
+            {
+                if (!partial.empty())
                 {
-                    // Otherwise the condition must be false. This is still relevant!
-                    printf("REQUIRES FALSE (%4d): %s\n", block->begin_line, block->condition.c_str());
+                    if (batch.size() == query_batch_size)
+                    {
+                        return read_status::more;
+                    }
+
+                    auto valid = add_entry(partial, batch);
+                    partial.clear();
+                    if (!valid)
+                    {
+                        return read_status::invalid;
+                    }
                 }
+                return read_status::end;
+            }
+
+            if (!batch.empty() && !input_ready())
+            {
+                return read_status::more;
+            }
+
+#ifdef _WIN32
+            auto size = _read(fd, buffer, sizeof(buffer));
+#else
+            auto size = ::read(fd, buffer, sizeof(buffer));
+            if ((size < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+#endif
+            if (size < 0)
+            {
+                return read_status::failed;
+            }
+
+            buffer_begin = 0;
+            buffer_end = static_cast<std::size_t>(size);
+            at_end = (size == 0);
+            filled_buffer = (buffer_end == sizeof(buffer));
+        }
+    }
+
+    std::string invalid_entry;
+    std::size_t skipped_entries = 0; // Entries that named some other file
+
+private:
+    // Returns whether a read would return without waiting on the writer. Windows has no way to check this for every kind
+    // of input, so a read that did not fill the buffer is taken to mean the writer has paused
+    bool input_ready() const
+    {
+#ifdef _WIN32
+        return filled_buffer;
+#else
+        pollfd request{ fd, POLLIN, 0 };
+        return poll(&request, 1, 0) > 0;
+#endif
+    }
+
+    bool add_entry(std::string_view entry, std::vector<int>& batch)
+    {
+        auto lineText = entry;
+        if (auto pos = lineText.rfind(':'); pos != lineText.npos)
+        {
+            if (!names_file(lineText.substr(0, pos)))
+            {
+                ++skipped_entries;
+                return true;
             }
+            lineText = lineText.substr(pos + 1);
+        }
+
+        int line = 0;
+        auto [ptr, err] = std::from_chars(lineText.data(), lineText.data() + lineText.size(), line);
+        if ((err != std::errc{}) || (ptr != lineText.data() + lineText.size()) || (line <= 0))
+        {
+            invalid_entry = entry;
+            return false;
+        }
+
+        batch.push_back(line);
+        return true;
+    }
+
+    // Returns whether 'name' refers to the file being queried. Tools tend to name the same few files over and over, so
+    // the result for each distinct name is remembered rather than normalizing it again
+    bool names_file(std::string_view name)
+    {
+        if (name == file_path)
+        {
+            return true;
+        }
+
+        if (name == last_name)
+        {
+            return last_name_matches;
+        }
+
+        if (canonical_file_path.empty())
+        {
+            return false;
+        }
+
+        auto [itr, inserted] = name_matches.try_emplace(std::string(name), false);
+        if (inserted)
+        {
+            std::error_code error;
+            auto canonical = std::filesystem::weakly_canonical(std::filesystem::path(itr->first), error);
+            itr->second = !error && (canonical == canonical_file_path);
+        }
+
+        last_name = itr->first;
+        last_name_matches = itr->second;
+        return last_name_matches;
+    }
+
+    int fd = -1;
+    bool owns_fd = false;
+    std::string_view file_path;
+    std::filesystem::path canonical_file_path; // Empty if the file is standard input or its path could not be normalized
+    std::unordered_map<std::string, bool> name_matches;
+    std::string_view last_name; // Refers to a key of 'name_matches'
+    bool last_name_matches = false;
+    char buffer[64 * 1024];
+    std::size_t buffer_begin = 0;
+    std::size_t buffer_end = 0;
+    bool filled_buffer = false;
+    bool at_end = false;
+    std::string partial; // An entry split across two reads
+};
+
+// Answers 'batch', which 'stream' returned 'status' for, and then the rest of the queries read from 'stream' a batch at a
+// time until the input ends. Each batch is flushed to stdout once answered so that a caller waiting on the answers sees
+// them. Returns false if an entry could not be read, after answering all entries that preceded it
+[[maybe_unused]] static bool answer_queries_from(const std::shared_ptr<const conditional_index>& index, query_stream& stream,
+    std::vector<int>& batch, query_stream::read_status status, std::size_t& queryCount)
+{
+    for (;;)
+    {
+        answer_queries(index, batch);
+        fflush(stdout);
+        queryCount += batch.size();
 
-            // Cannot occur in any other conditional in the list...
+        switch (status)
+        {
+        case query_stream::read_status::more:
             break;
+        case query_stream::read_status::end:
+            return true;
+        case query_stream::read_status::invalid:
+            printf("ERROR: Invalid line number '%s'\n", stream.invalid_entry.c_str());
+            return false;
+        case query_stream::read_status::failed:
+            printf("ERROR: Failed to read line numbers\n");
+            return false;
+        }
+
+        batch.clear();
+        status = stream.read_batch(batch);
+    }
+}
+
+#ifdef WHEN_PRESENT_FUZZ
+// Work budgets for the complexity fuzz target. Finding each newline touches the bytes of its line once, and classifying
+// the line touches at most as many again
+static constexpr std::size_t fuzz_max_bytes_scanned_per_byte = 2;
+
+// Each level of a query searches a list of siblings and walks the blocks of the conditional it finds, each of which is a
+// requirement. A search costs a binary search down to a window of 'sibling_search_window' values, so a level is allowed
+// that much work on top of its requirements
+static constexpr std::size_t fuzz_max_nodes_per_level = 32 + sibling_search_window;
+
+// Flags inputs whose scan or queries do more work than their size and output account for, which is how performance
+// cliffs (e.g. rescanning long continuation chains or walking wide sibling lists) show up. Every line is queried both
+// by searching the tree and through the dense line table. Run it with '-close_fd_mask=1' to hide the error output for
+// invalid trees
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+    std::string contents(reinterpret_cast<const char*>(data), size);
+    std::vector<std::size_t> offsets;
+    decode_input(contents, offsets);
+
+    fuzz_work = {};
+    newline_table newlines;
+    auto directives = scan_directives(contents, &newlines);
+    if (fuzz_work.bytes_scanned > fuzz_max_bytes_scanned_per_byte * contents.size())
+    {
+        fprintf(stderr, "Scanning %zu bytes touched %zu bytes\n", contents.size(), fuzz_work.bytes_scanned);
+        abort();
+    }
+
+    auto lineCount = static_cast<int>(newlines.offsets.size()) + 1;
+    for (auto expectedQueries : { std::size_t(0), SIZE_MAX })
+    {
+        auto index = build_index(directives, newline_table(), expectedQueries);
+        if (!index)
+        {
+            return 0;
+        }
+
+        // Lines before the first have no requirements, whichever way the index is searched
+        std::pmr::vector<requirement> requirements;
+        for (auto line : { 0, -1 })
+        {
+            index->query(line, requirements);
+            if (!requirements.empty())
+            {
+                fprintf(stderr, "Querying line %d gave requirements\n", line);
+                abort();
+            }
+        }
+
+        for (int line = 1; line <= lineCount; ++line)
+        {
+            // Levels are counted by the requirements that are true, plus one for the level where the search ends
+            fuzz_work = {};
+            requirements.clear();
+            index->query(line, requirements);
+            auto levels = 1 + static_cast<std::size_t>(
+                std::count_if(requirements.begin(), requirements.end(), [](auto& req) { return req.value; }));
+            if (fuzz_work.nodes_visited > requirements.size() + levels * fuzz_max_nodes_per_level)
+            {
+                fprintf(stderr, "Querying line %d of %d %s visited %zu nodes for %zu requirements\n", line, lineCount,
+                    index->line_table.empty() ? "in the tree" : "in the line table", fuzz_work.nodes_visited,
+                    requirements.size());
+                abort();
+            }
         }
     }
+
+    return 0;
 }
+#endif
+
+#if defined(WHEN_PRESENT_FUZZ) && defined(WHEN_PRESENT_FUZZ_REPLAY)
+// Runs the fuzz target over the given files and the files in the given directories, e.g. the stored regression inputs,
+// without a fuzzing engine
+int main(int argc, char** argv)
+{
+    std::vector<std::filesystem::path> paths;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::filesystem::is_directory(argv[i]))
+        {
+            for (auto& entry : std::filesystem::directory_iterator(argv[i]))
+            {
+                paths.push_back(entry.path());
+            }
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+
+    for (auto& path : paths)
+    {
+        std::string contents;
+        if (!read_file(path.string(), contents))
+        {
+            printf("ERROR: Failed to read file \"%s\"\n", path.string().c_str());
+            return 1;
+        }
 
+        printf("%s\n", path.string().c_str());
+        fflush(stdout);
+        LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(contents.data()), contents.size());
+    }
+    printf("%zu inputs passed\n", paths.size());
+}
+#elif !defined(WHEN_PRESENT_FUZZ)
 int main(int argc, char** argv)
 {
     std::string filePath;
     std::vector<int> lines;
+    std::string linesFromPath;
+    std::vector<std::size_t> offsets;
+    bool showStats = false;
+    std::string tracePath;
 
     auto begin = argv + 1;
     auto end = argv + argc;
@@ -148,6 +1877,52 @@ int main(int argc, char** argv)
             }
             --begin;
         }
+        else if (arg == "--offsets"sv)
+        {
+            ++begin;
+            for (; (begin != end) && (**begin != '-'); ++begin)
+            {
+                std::string_view value = *begin;
+                std::size_t offset = 0;
+                auto [ptr, err] = std::from_chars(value.data(), value.data() + value.size(), offset);
+                if ((err != std::errc{}) || (ptr != value.data() + value.size()))
+                {
+                    printf("ERROR: Invalid byte offset '%s'\n", *begin);
+                    return print_usage(), 1;
+                }
+                offsets.push_back(offset);
+            }
+
+            if (begin == end)
+            {
+                break;
+            }
+            --begin;
+        }
+        else if (arg == "--lines-from"sv)
+        {
+            ++begin;
+            if (begin == end)
+            {
+                printf("ERROR: Missing line number path\n");
+                return print_usage(), 1;
+            }
+            linesFromPath = *begin;
+        }
+        else if (arg == "--stats"sv)
+        {
+            showStats = true;
+        }
+        else if (arg == "--trace"sv)
+        {
+            ++begin;
+            if (begin == end)
+            {
+                printf("ERROR: Missing trace path\n");
+                return print_usage(), 1;
+            }
+            tracePath = *begin;
+        }
         else if (arg == "--help"sv)
         {
             return print_usage(), 0;
@@ -164,139 +1939,195 @@ int main(int argc, char** argv)
         printf("ERROR: Must specify file path\n");
         return print_usage(), 1;
     }
-    else if (lines.empty())
+    else if (lines.empty() && linesFromPath.empty() && offsets.empty())
     {
         printf("ERROR: Must specify line number(s)\n");
         return print_usage(), 1;
     }
-
-    // Read the entire file one line at a time, generating a tree that describes preprocessor requirements
-    std::ifstream stream(filePath);
-    if (stream.fail())
+    else if ((filePath == "-"sv) && (linesFromPath == "-"sv))
     {
-        printf("ERROR: Failed to open file \"%s\"\n", filePath.c_str());
-        return 1;
+        printf("ERROR: Cannot read both the file and line numbers from standard input\n");
+        return print_usage(), 1;
     }
 
-    std::vector<conditional> conditionals;
-    std::vector<conditional*> stateStack;
+    tracing_enabled = !tracePath.empty();
+    if (showStats)
+    {
+        counters.open();
+    }
+    trace_thread("main");
 
-    std::string currentLine;
-    for (int currentLineNumber = 1, linesRead; stream.good(); currentLineNumber += linesRead)
+    // Read the entire file up front. Scanning operates on the in-memory contents, which allows large files to be split
+    // into chunks and scanned in parallel
+    std::string contents;
     {
-        linesRead = 1;
-        // Lines that end with '\' get appended with the next line. This may have valuable information if the next line
-        // is part of a preprocessor condition, so merge the two
-        std::getline(stream, currentLine);
-        while (stream.good() && !currentLine.empty() && (currentLine.back() == '\\'))
+        trace_scope trace("read");
+        phase_scope phaseScope(phase::read);
+        if (!read_file(filePath, contents))
         {
-            currentLine.push_back('\n');
-            std::string next;
-            std::getline(stream, next);
-            currentLine += next;
-            ++linesRead;
+            printf("ERROR: Failed to open file \"%s\"\n", filePath.c_str());
+            return 1;
         }
+    }
 
-        // Leading whitespace is ignored
-        auto pos = currentLine.find_first_not_of(whitespace);
-        if (pos == currentLine.npos)
+    for (auto offset : offsets)
+    {
+        if (offset >= contents.size())
         {
-            continue;
+            printf("ERROR: Byte offset %zu is past the end of the file\n", offset);
+            return 1;
         }
+    }
+
+    // The scanner only understands UTF-8, so anything with a UTF-16 byte order mark is converted up front. Offsets are
+    // given in terms of the file as it is on disk, so they're converted along with it
+    auto fileSize = contents.size();
+    auto textOffsets = offsets;
+    text_encoding encoding;
+    {
+        trace_scope trace("decode");
+        phase_scope phaseScope(phase::read);
+        encoding = decode_input(contents, textOffsets);
+    }
+
+    std::vector<directive> directives;
+    newline_table newlines;
+    {
+        trace_scope trace("scan");
+        phase_scope phaseScope(phase::scan);
+        directives = scan_directives(contents, offsets.empty() ? nullptr : &newlines);
+    }
 
-        // Preprocessor directives must be first (e.g. cannot be after any other statement)
-        if (currentLine[pos] != '#')
+    // Streamed queries have no known count, so the first batch is read before the index is built and its size stands in
+    // for the rest. A full batch means a large stream that will pay for the dense table; a caller writing one query at a
+    // time and waiting on each answer stalls the first batch early, so it is not made to wait for the table to be built
+    query_stream stream;
+    std::vector<int> firstBatch;
+    auto firstStatus = query_stream::read_status::end;
+    if (!linesFromPath.empty())
+    {
+        if (!stream.open(linesFromPath, filePath))
         {
-            continue;
+            printf("ERROR: Failed to open file \"%s\"\n", linesFromPath.c_str());
+            return 1;
         }
 
-        // There can be space after the '#', e.g. "#   if ..."
-        pos = currentLine.find_first_not_of(whitespace, pos + 1);
-        if (pos == currentLine.npos)
+        trace_scope trace("read queries");
+        firstStatus = stream.read_batch(firstBatch);
+    }
+
+    std::shared_ptr<const conditional_index> index;
+    std::size_t queryCount = 0;
+    {
+        trace_scope trace("build");
+        phase_scope phaseScope(phase::build);
+        auto expectedQueries = (firstBatch.size() == query_batch_size) ? SIZE_MAX :
+            (lines.size() + offsets.size() + firstBatch.size());
+        index = build_index(directives, std::move(newlines), expectedQueries);
+        if (!index)
         {
-            // This is ill-formed, but ignore...
-            continue;
+            return -1;
         }
+    }
 
-        // Determine which directive this is
-        auto endPos = pos;
-        for (; endPos < currentLine.length(); ++endPos)
+    {
+        trace_scope trace("query");
+        phase_scope phaseScope(phase::query);
+        answer_queries(index, lines);
+        queryCount = lines.size();
+        if (!linesFromPath.empty() && !answer_queries_from(index, stream, firstBatch, firstStatus, queryCount))
         {
-            if (!std::isalpha(currentLine[endPos]))
-            {
-                break;
-            }
+            return 1;
         }
 
-        std::string_view directive{ currentLine.c_str() + pos, endPos - pos };
-        if (directive == "if"sv || directive == "ifdef"sv || directive == "ifndef"sv)
+        std::pmr::vector<requirement> requirements;
+        std::string output;
+        for (std::size_t i = 0; i < offsets.size(); ++i)
         {
-            // This is the start of a new, possibly nested, conditional
-            if (stateStack.empty())
-            {
-                // This is "top level"
-                conditionals.emplace_back();
-                stateStack.push_back(&conditionals.back());
-            }
-            else
-            {
-                // Nested inside of another conditional block
-                auto& currentBlock = stateStack.back()->blocks.back();
-                currentBlock->nested_conditionals.emplace_back();
-                stateStack.push_back(&currentBlock->nested_conditionals.back());
-            }
+            auto offset = offsets[i];
+            auto line = index->line_from_offset(textOffsets[i]);
+            requirements.clear();
+            index->query(line, requirements);
 
-            auto& cond = *stateStack.back();
-            assert(cond.blocks.empty());
-            cond.begin_line = currentLineNumber;
-            cond.blocks.emplace_back(std::make_unique<conditional_block>());
-            cond.blocks.back()->begin_line = currentLineNumber;
-            cond.blocks.back()->condition = currentLine;
+            printf("Requirements for byte offset %zu (line %d) being included in the translation unit:\n", offset, line);
+            output.clear();
+            format_requirements(requirements, output);
+            fwrite(output.data(), 1, output.size(), stdout);
         }
-        else if (directive == "else"sv || directive == "elif"sv)
-        {
-            if (stateStack.empty())
-            {
-                std::wcout << L"ERROR: Encountered else outside of a conditional\n";
-                return -1;
-            }
+        queryCount += offsets.size();
+    }
 
-            auto& cond = *stateStack.back();
-            assert(!cond.blocks.empty());
-            cond.blocks.back()->end_line = currentLineNumber;
+    if (showStats)
+    {
+        tree_statistics stats;
+        collect_statistics(index->conditionals, stats);
+        auto toMilliseconds = [](std::chrono::steady_clock::duration duration) {
+            return std::chrono::duration<double, std::milli>(duration).count();
+        };
+        auto parseTime = toMilliseconds(phase_durations[static_cast<std::size_t>(phase::read)] +
+            phase_durations[static_cast<std::size_t>(phase::scan)] + phase_durations[static_cast<std::size_t>(phase::build)]);
+        auto queryTime = toMilliseconds(phase_durations[static_cast<std::size_t>(phase::query)]);
 
-            cond.blocks.emplace_back(std::make_unique<conditional_block>());
-            cond.blocks.back()->begin_line = currentLineNumber;
-            cond.blocks.back()->condition = currentLine;
+        printf("Statistics:\n");
+        printf("    File size:    %zu bytes\n", fileSize);
+        printf("    Encoding:     %s\n", encoding_names[static_cast<std::size_t>(encoding)]);
+        printf("    Directives:   %zu\n", directives.size());
+        printf("    Conditionals: %zu\n", stats.conditionals);
+        printf("    Blocks:       %zu\n", stats.blocks);
+        printf("    Max depth:    %zu\n", stats.max_depth);
+        printf("    Conditions:   %zu distinct\n", index->conditions.size());
+        printf("    Tree memory:  %zu bytes\n", sizeof(conditional_index) + stats.bytes +
+            index->conditions.text.capacity() + index->conditions.offsets.capacity() * sizeof(std::uint32_t) +
+            index->sibling_begin_lines.capacity() * sizeof(int) +
+            index->eytzinger_begin_lines.capacity() * sizeof(eytzinger_entry) +
+            index->newlines.memory_usage() +
+            index->line_states.capacity() * sizeof(conditional_index::line_state) +
+            index->line_table.capacity() * sizeof(std::uint32_t));
+        printf("    Line table:   %zu lines\n", index->line_table.size());
+        printf("    Parse time:   %.3f ms (%.1f MB/s)\n", parseTime,
+            (parseTime > 0) ? (fileSize / (1024.0 * 1024.0)) / (parseTime / 1000) : 0.0);
+        printf("    Query time:   %.3f ms (%zu lines)\n", queryTime, queryCount);
+        if (!linesFromPath.empty())
+        {
+            printf("    Skipped:      %zu entries naming other files\n", stream.skipped_entries);
         }
-        else if (directive == "endif"sv)
+
+        if (!counters.available)
         {
-            // End of the current conditional
-            if (stateStack.empty())
+            printf("    Hardware counters: unavailable\n");
+        }
+        else
+        {
+            printf("    Hardware counters:\n        %-8s", "");
+            for (auto name : hardware_counters::names)
             {
-                std::wcout << L"ERROR: Encountered '#endif' with no matching conditional\n";
-                return -1;
+                printf("%15s", name);
             }
+            printf("\n");
 
-            auto& cond = *stateStack.back();
-            assert(!cond.blocks.empty());
-            cond.end_line = currentLineNumber;
-            cond.blocks.back()->end_line = currentLineNumber;
-            stateStack.pop_back();
+            for (std::size_t i = 0; i < static_cast<std::size_t>(phase::count); ++i)
+            {
+                printf("        %-8s", phase_names[i]);
+                for (auto value : counters.totals[i])
+                {
+                    if (value < 0)
+                    {
+                        printf("%15s", "n/a");
+                    }
+                    else
+                    {
+                        printf("%15.0f", value);
+                    }
+                }
+                printf("\n");
+            }
         }
-        // Otherwise, something we don't care about, e.g. pragma define, etc.
-    }
-
-    if (!stateStack.empty())
-    {
-        std::wcout << L"ERROR: Reached end of file with an active conditional block\n";
-        return -1;
     }
 
-    for (auto line : lines)
+    if (!tracePath.empty() && !write_trace(tracePath, filePath))
     {
-        printf("Requirements for line %d being included in the translation unit:\n", line);
-        process_line(line, conditionals);
-        printf("\n");
+        printf("ERROR: Failed to write trace file \"%s\"\n", tracePath.c_str());
+        return 1;
     }
 }
+#endif
@@ -0,0 +1,110 @@
+// Searches over sorted lists of sibling begin lines. The runtime index uses these to find the conditional that can
+// contain a line without touching the conditionals themselves; bench/sibling_search_benchmark.cpp compares them
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define WHEN_PRESENT_SSE2
+#endif
+
+// Counts the values a search compares against. The complexity fuzz target in main.cpp defines this to check the cost of
+// queries
+#ifndef WHEN_PRESENT_COUNT_VISITED
+#define WHEN_PRESENT_COUNT_VISITED(nodes)
+#endif
+
+// Sibling searches narrow the range with a binary search until it is at most this size, then count the rest in bulk
+inline constexpr std::size_t sibling_search_window = 16;
+
+// Returns the number of values in the sorted array 'values' that are less than or equal to 'value'
+inline std::size_t count_less_equal(const int* values, std::size_t size, int value)
+{
+    std::size_t base = 0;
+    while (size > sibling_search_window)
+    {
+        WHEN_PRESENT_COUNT_VISITED(1);
+        auto half = size / 2;
+        if (values[base + half - 1] <= value)
+        {
+            base += half;
+            size -= half;
+        }
+        else
+        {
+            size = half;
+        }
+    }
+
+    // The remaining values are contiguous, so compare several at once rather than branching on each
+    WHEN_PRESENT_COUNT_VISITED(size);
+    auto count = base;
+    std::size_t i = 0;
+#ifdef WHEN_PRESENT_SSE2
+    static constexpr int bitCounts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    auto target = _mm_set1_epi32(value);
+    for (; i + 4 <= size; i += 4)
+    {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + base + i));
+        auto greater = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(chunk, target)));
+        count += 4 - bitCounts[greater];
+    }
+#endif
+    for (; i < size; ++i)
+    {
+        count += (values[base + i] <= value) ? 1 : 0;
+    }
+
+    return count;
+}
+
+// An entry in an Eytzinger (breadth first) layout. The sorted position is stored alongside the value since the search
+// ends on a node it has already visited, so the position is already in cache
+struct eytzinger_entry
+{
+    int value;
+    std::uint32_t rank; // The position of 'value' in sorted order
+};
+
+// Returns the number of values less than or equal to 'value' given values in Eytzinger order, 1-based such that the
+// children of 'entries[k - 1]' are 'entries[2k - 1]' and 'entries[2k]'
+inline std::size_t count_less_equal_eytzinger(const eytzinger_entry* entries, std::size_t size, int value)
+{
+    std::size_t k = 1;
+    while (k <= size)
+    {
+#ifdef WHEN_PRESENT_SSE2
+        // Eight entries share a cache line, so fetch the line holding the descendants three levels down
+        _mm_prefetch(reinterpret_cast<const char*>(entries + (std::min(k * 8, size) - 1)), _MM_HINT_T0);
+#endif
+        WHEN_PRESENT_COUNT_VISITED(1);
+        k = 2 * k + ((entries[k - 1].value <= value) ? 1 : 0);
+    }
+
+    // Undo the trailing right turns, plus the final left turn, to arrive at the first value greater than 'value'
+    while (k & 1)
+    {
+        k >>= 1;
+    }
+    k >>= 1;
+
+    return (k == 0) ? size : entries[k - 1].rank;
+}
+
+// Fills 'entries' with 'size' values in Eytzinger order, starting with the subtree rooted at (1-based) position 'k'.
+// 'value(i)' gives the i-th value in sorted order. Returns the sorted position of the next value to place
+template <typename Value>
+std::size_t fill_eytzinger(Value&& value, std::size_t size, std::size_t next, std::size_t k, eytzinger_entry* entries)
+{
+    if (k <= size)
+    {
+        next = fill_eytzinger(value, size, next, 2 * k, entries);
+        entries[k - 1] = eytzinger_entry{ value(next), static_cast<std::uint32_t>(next) };
+        next = fill_eytzinger(value, size, next + 1, 2 * k + 1, entries);
+    }
+
+    return next;
+}
@@ -0,0 +1,746 @@
+// Differential test for when_present. Generates source files with deep nesting, continuation chains, wide sibling lists,
+// mixed line endings and byte order marks, then checks the tool's answers against a reference implementation. The
+// reference is the original line at a time loop: it reads one line at a time, builds the tree with no indexing at all
+// and answers each query with a linear walk, so it shares no code with the tool.
+//
+// Usage: differential_test <path to when_present> <working directory>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+struct reference_block;
+
+struct reference_conditional
+{
+    int begin_line;
+    int end_line;
+    std::vector<std::unique_ptr<reference_block>> blocks;
+};
+
+struct reference_block
+{
+    int begin_line;
+    int end_line;
+    std::string condition;
+    std::vector<reference_conditional> nested_conditionals;
+};
+
+enum class directive_role
+{
+    none,
+    begin,
+    alternative,
+    end,
+};
+
+static directive_role reference_role(std::string_view line)
+{
+    static constexpr auto whitespace = " \t\v"sv;
+    auto pos = line.find_first_not_of(whitespace);
+    if ((pos == line.npos) || (line[pos] != '#'))
+    {
+        return directive_role::none;
+    }
+
+    pos = line.find_first_not_of(whitespace, pos + 1);
+    if (pos == line.npos)
+    {
+        return directive_role::none;
+    }
+
+    auto endPos = pos;
+    while ((endPos < line.size()) &&
+        (((line[endPos] >= 'a') && (line[endPos] <= 'z')) || ((line[endPos] >= 'A') && (line[endPos] <= 'Z')) ||
+            (line[endPos] == '_')))
+    {
+        ++endPos;
+    }
+
+    auto name = line.substr(pos, endPos - pos);
+    if ((name == "if"sv) || (name == "ifdef"sv) || (name == "ifndef"sv))
+    {
+        return directive_role::begin;
+    }
+    else if ((name == "elif"sv) || (name == "elifdef"sv) || (name == "elifndef"sv) || (name == "else"sv))
+    {
+        return directive_role::alternative;
+    }
+    else if (name == "endif"sv)
+    {
+        return directive_role::end;
+    }
+
+    return directive_role::none;
+}
+
+// Builds the tree for 'text' (UTF-8, without a byte order mark). Returns the error message on failure, or an empty
+// string on success
+static std::string reference_parse(const std::string& text, std::vector<reference_conditional>& conditionals)
+{
+    std::istringstream stream(text);
+    std::vector<reference_conditional*> stateStack;
+    std::string currentLine;
+    for (int currentLineNumber = 1, linesRead; stream.good(); currentLineNumber += linesRead)
+    {
+        // Lines that end with '\' (ignoring a '\r' before the newline) are joined with the next line
+        linesRead = 1;
+        std::getline(stream, currentLine);
+        auto isContinued = [](const std::string& line) {
+            auto size = line.size() - ((!line.empty() && (line.back() == '\r')) ? 1 : 0);
+            return (size > 0) && (line[size - 1] == '\\');
+        };
+        while (stream.good() && isContinued(currentLine))
+        {
+            std::string next;
+            std::getline(stream, next);
+            currentLine += '\n';
+            currentLine += next;
+            ++linesRead;
+        }
+
+        if (!currentLine.empty() && (currentLine.back() == '\r'))
+        {
+            currentLine.pop_back();
+        }
+
+        auto role = reference_role(currentLine);
+        if (role == directive_role::begin)
+        {
+            if (stateStack.empty())
+            {
+                conditionals.emplace_back();
+                stateStack.push_back(&conditionals.back());
+            }
+            else
+            {
+                auto& currentBlock = stateStack.back()->blocks.back();
+                currentBlock->nested_conditionals.emplace_back();
+                stateStack.push_back(&currentBlock->nested_conditionals.back());
+            }
+
+            auto& cond = *stateStack.back();
+            cond.begin_line = currentLineNumber;
+            cond.blocks.push_back(std::make_unique<reference_block>());
+            cond.blocks.back()->begin_line = currentLineNumber;
+            cond.blocks.back()->condition = currentLine;
+        }
+        else if (role == directive_role::alternative)
+        {
+            if (stateStack.empty())
+            {
+                return "ERROR: Encountered else outside of a conditional\n";
+            }
+
+            auto& cond = *stateStack.back();
+            cond.blocks.back()->end_line = currentLineNumber;
+            cond.blocks.push_back(std::make_unique<reference_block>());
+            cond.blocks.back()->begin_line = currentLineNumber;
+            cond.blocks.back()->condition = currentLine;
+        }
+        else if (role == directive_role::end)
+        {
+            if (stateStack.empty())
+            {
+                return "ERROR: Encountered '#endif' with no matching conditional\n";
+            }
+
+            auto& cond = *stateStack.back();
+            cond.end_line = currentLineNumber;
+            cond.blocks.back()->end_line = currentLineNumber;
+            stateStack.pop_back();
+        }
+    }
+
+    if (!stateStack.empty())
+    {
+        return "ERROR: Reached end of file with an active conditional block\n";
+    }
+
+    return {};
+}
+
+static void reference_query(int line, const std::vector<reference_conditional>& conditionals, std::string& output)
+{
+    char buffer[64];
+    for (auto& cond : conditionals)
+    {
+        if ((cond.begin_line <= line) && (cond.end_line >= line))
+        {
+            for (auto& block : cond.blocks)
+            {
+                auto contains = (block->begin_line <= line) && (block->end_line > line);
+                snprintf(buffer, sizeof(buffer), contains ? "REQUIRES TRUE (%4d):  " : "REQUIRES FALSE (%4d): ",
+                    block->begin_line);
+                output += buffer;
+                output += block->condition;
+                output += '\n';
+                if (contains)
+                {
+                    reference_query(line, block->nested_conditionals, output);
+                    break;
+                }
+            }
+            break;
+        }
+    }
+}
+
+enum class line_endings
+{
+    lf,
+    crlf,
+    mixed,
+};
+
+enum class encoding
+{
+    utf8,
+    utf8_bom,
+    utf16le,
+    utf16be,
+};
+
+struct generator_options
+{
+    std::size_t size = 4 * 1024; // Approximate size of the generated text
+    int max_depth = 8;
+    int top_level_siblings = 0; // If non-zero, a run of this many empty top level conditionals comes first
+    int nested_siblings = 0; // If non-zero, a conditional containing this many nested conditionals comes first
+    int chain_depth = 0; // If non-zero, a chain of conditionals nested this deep comes first
+    int continuation_length = 3; // The maximum number of lines in a continuation chain
+    line_endings endings = line_endings::lf;
+    bool non_ascii = false;
+};
+
+// Generates UTF-8 source text. Directives are mixed with code, comments, directive-like text inside continued macros and
+// unrecognised directives. Everything that is opened is closed, so the result is always well formed
+struct source_generator
+{
+    explicit source_generator(std::uint32_t seed, const generator_options& options) : random(seed), options(options)
+    {
+    }
+
+    std::size_t pick(std::size_t count)
+    {
+        return random() % count;
+    }
+
+    void line(std::string_view content)
+    {
+        text += content;
+        auto crlf = (options.endings == line_endings::crlf) || ((options.endings == line_endings::mixed) && pick(2));
+        text += crlf ? "\r\n"sv : "\n"sv;
+    }
+
+    std::string condition()
+    {
+        static constexpr std::string_view names[] = { "_WIN32"sv, "FEATURE_A"sv, "FEATURE_B"sv, "NDEBUG"sv, "X"sv };
+        auto name = std::string(names[pick(std::size(names))]);
+        switch (pick(4))
+        {
+        case 0:
+            return name;
+        case 1:
+            return "defined(" + name + ") && !defined(OTHER)";
+        case 2:
+            return name + " > " + std::to_string(pick(100));
+        default:
+            return "(" + name + ")";
+        }
+    }
+
+    // Writes a directive whose text may be continued across several lines
+    void directive(std::string_view name, bool hasCondition)
+    {
+        static constexpr std::string_view spacing[] = { ""sv, " "sv, "\t"sv, "  "sv };
+        std::string start = std::string(spacing[pick(3) ? 0 : pick(std::size(spacing))]) + "#" +
+            std::string(spacing[pick(4) ? 0 : pick(std::size(spacing))]) + std::string(name);
+        if (!hasCondition)
+        {
+            line(start);
+            return;
+        }
+
+        start += " " + condition();
+        auto continuations = pick(4) ? 0 : pick(options.continuation_length + 1);
+        for (std::size_t i = 0; i < continuations; ++i)
+        {
+            line(start + " \\");
+            start = "    && " + condition();
+        }
+        line(start);
+    }
+
+    void code()
+    {
+        static constexpr std::string_view lines[] = {
+            "int value = compute(first, second);"sv,
+            ""sv,
+            "    "sv,
+            "// #if inside a comment is still a directive to the scanner, but not here"sv,
+            "void function();"sv,
+            "#define MACRO(x) ((x) + 1)"sv,
+            "#include <header.h>"sv,
+            "#pragma once"sv,
+            "#ifdef_not_a_directive"sv,
+            "# 42 \"line_marker.h\""sv,
+            "#"sv,
+            "#error message"sv,
+        };
+
+        switch (pick(16))
+        {
+        case 0:
+            // A macro whose continuation lines look like directives, which must not be treated as such
+            line("#define CONTINUED(x) \\");
+            line("#endif \\");
+            line("    (x)");
+            break;
+        case 1:
+            if (options.non_ascii)
+            {
+                line("// Non-ASCII text: caf\xC3\xA9, \xE2\x82\xAC, \xF0\x9F\x98\x80");
+                break;
+            }
+            [[fallthrough]];
+        default:
+            line(lines[pick(std::size(lines))]);
+            break;
+        }
+    }
+
+    void conditional(int depth)
+    {
+        static constexpr std::string_view begins[] = { "if"sv, "ifdef"sv, "ifndef"sv };
+        static constexpr std::string_view alternatives[] = { "elif"sv, "elifdef"sv, "elifndef"sv };
+        directive(begins[pick(std::size(begins))], true);
+        auto blocks = pick(4);
+        for (std::size_t i = 0; i <= blocks; ++i)
+        {
+            if (i > 0)
+            {
+                if ((i == blocks) && pick(2))
+                {
+                    directive("else"sv, false);
+                }
+                else
+                {
+                    directive(alternatives[pick(std::size(alternatives))], true);
+                }
+            }
+            body(depth + 1, 1 + pick(6));
+        }
+        directive("endif"sv, false);
+    }
+
+    void body(int depth, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if ((depth < options.max_depth) && (text.size() < options.size) && (pick(4) == 0))
+            {
+                conditional(depth);
+            }
+            else
+            {
+                code();
+            }
+        }
+    }
+
+    std::string generate()
+    {
+        for (int i = 0; i < options.top_level_siblings; ++i)
+        {
+            directive("ifdef"sv, true);
+            code();
+            directive("endif"sv, false);
+        }
+
+        for (int i = 0; i < options.chain_depth; ++i)
+        {
+            directive("if"sv, true);
+            body(options.max_depth, pick(3));
+        }
+        for (int i = 0; i < options.chain_depth; ++i)
+        {
+            if (pick(2))
+            {
+                directive("else"sv, false);
+                body(options.max_depth, pick(3));
+            }
+            directive("endif"sv, false);
+        }
+
+        if (options.nested_siblings > 0)
+        {
+            directive("if"sv, true);
+            for (int i = 0; i < options.nested_siblings; ++i)
+            {
+                directive("ifndef"sv, true);
+                directive("endif"sv, false);
+            }
+            directive("else"sv, false);
+            code();
+            directive("endif"sv, false);
+        }
+
+        while (text.size() < options.size)
+        {
+            body(0, 1);
+        }
+
+        return std::move(text);
+    }
+
+    std::mt19937 random;
+    generator_options options;
+    std::string text;
+};
+
+// Returns the length of the UTF-8 sequence that starts with 'lead'
+static std::size_t utf8_sequence_length(char lead)
+{
+    auto ch = static_cast<unsigned char>(lead);
+    return (ch < 0x80) ? 1 : (ch < 0xE0) ? 2 : (ch < 0xF0) ? 3 : 4;
+}
+
+// Returns the number of bytes the UTF-8 sequence at 'pos' occupies in the given encoding
+static std::size_t encoded_length(const std::string& text, std::size_t pos, encoding enc)
+{
+    auto length = utf8_sequence_length(text[pos]);
+    if ((enc == encoding::utf16le) || (enc == encoding::utf16be))
+    {
+        return (length == 4) ? 4 : 2;
+    }
+    return length;
+}
+
+static std::string encode(const std::string& text, encoding enc)
+{
+    if (enc == encoding::utf8)
+    {
+        return text;
+    }
+    else if (enc == encoding::utf8_bom)
+    {
+        return "\xEF\xBB\xBF" + text;
+    }
+
+    auto bigEndian = (enc == encoding::utf16be);
+    std::string result = bigEndian ? "\xFE\xFF" : "\xFF\xFE";
+    auto appendUnit = [&](std::uint32_t unit) {
+        auto high = static_cast<char>(unit >> 8);
+        auto low = static_cast<char>(unit & 0xFF);
+        result += bigEndian ? high : low;
+        result += bigEndian ? low : high;
+    };
+
+    for (std::size_t pos = 0; pos < text.size();)
+    {
+        auto length = utf8_sequence_length(text[pos]);
+        std::uint32_t codePoint = static_cast<unsigned char>(text[pos]) & (0xFF >> (length + (length > 1 ? 1 : 0)));
+        for (std::size_t i = 1; i < length; ++i)
+        {
+            codePoint = (codePoint << 6) | (static_cast<unsigned char>(text[pos + i]) & 0x3F);
+        }
+        pos += length;
+
+        if (codePoint >= 0x10000)
+        {
+            codePoint -= 0x10000;
+            appendUnit(0xD800 + (codePoint >> 10));
+            appendUnit(0xDC00 + (codePoint & 0x3FF));
+        }
+        else
+        {
+            appendUnit(codePoint);
+        }
+    }
+
+    return result;
+}
+
+static std::string quote(const std::string& str)
+{
+    return "\"" + str + "\"";
+}
+
+struct test_context
+{
+    std::string tool;
+    std::filesystem::path directory;
+    int cases = 0;
+    int runs = 0;
+    int failures = 0;
+};
+
+static std::string read_text_file(const std::filesystem::path& path)
+{
+    std::ifstream stream(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << stream.rdbuf();
+    return contents.str();
+}
+
+static void write_text_file(const std::filesystem::path& path, std::string_view contents)
+{
+    std::ofstream stream(path, std::ios::binary);
+    stream.write(contents.data(), contents.size());
+}
+
+// Runs the tool with the given arguments, returning its output and whether it exited successfully
+static bool run_tool(test_context& context, const std::string& arguments, const std::string& input, std::string& output)
+{
+    auto outputPath = context.directory / "output.txt";
+    auto command = quote(context.tool) + " " + arguments + " > " + quote(outputPath.string()) + " 2>&1";
+    if (!input.empty())
+    {
+        command += " < " + quote(input);
+    }
+#ifdef _WIN32
+    // cmd.exe strips the outermost quotes of the command
+    command = quote(command);
+#endif
+
+    auto status = std::system(command.c_str());
+    output = read_text_file(outputPath);
+    return status == 0;
+}
+
+static void check(test_context& context, const std::string& name, const std::string& arguments, bool expectSuccess,
+    const std::string& expected, const std::string& actual, bool succeeded)
+{
+    ++context.runs;
+    if ((succeeded == expectSuccess) && (actual == expected))
+    {
+        return;
+    }
+
+    ++context.failures;
+    printf("FAILED: %s\n    when_present %s\n", name.c_str(), arguments.c_str());
+    if (succeeded != expectSuccess)
+    {
+        printf("    Expected the tool to %s\n", expectSuccess ? "succeed" : "fail");
+    }
+
+    std::size_t pos = 0;
+    while ((pos < expected.size()) && (pos < actual.size()) && (expected[pos] == actual[pos]))
+    {
+        ++pos;
+    }
+    auto lineBegin = expected.rfind('\n', pos);
+    lineBegin = (lineBegin == expected.npos) ? 0 : lineBegin + 1;
+    auto excerpt = [&](const std::string& str) {
+        auto end = str.find('\n', pos);
+        return str.substr(lineBegin, (end == str.npos ? str.size() : end) - lineBegin);
+    };
+    printf("    First difference at byte %zu\n    Expected: %s\n    Actual:   %s\n", pos, excerpt(expected).c_str(),
+        excerpt(actual).c_str());
+}
+
+// Runs every kind of query against a generated file and compares the results with the reference
+static void run_case(test_context& context, const std::string& name, const std::string& text, encoding enc,
+    std::uint32_t seed, std::size_t maxQueries, bool useStdin = false)
+{
+    ++context.cases;
+    std::mt19937 random(seed);
+    auto fileName = name + ".h";
+    auto filePath = (context.directory / fileName).string();
+    write_text_file(filePath, encode(text, enc));
+    auto fileArgument = useStdin ? "-"s : filePath;
+    auto input = useStdin ? filePath : ""s;
+
+    std::vector<reference_conditional> conditionals;
+    auto error = reference_parse(text, conditionals);
+    int lineCount = 1;
+    for (auto ch : text)
+    {
+        lineCount += (ch == '\n') ? 1 : 0;
+    }
+
+    // Query every line when that is affordable, otherwise a random sample. Some entries name the file, and some name a
+    // different file, which must be ignored
+    std::string queries;
+    std::string expected;
+    char buffer[160];
+    auto addQuery = [&](int line, std::string& output) {
+        snprintf(buffer, sizeof(buffer), "Requirements for line %d being included in the translation unit:\n", line);
+        output += buffer;
+        reference_query(line, conditionals, output);
+        output += '\n';
+    };
+
+    auto queryCount = std::min<std::size_t>(maxQueries, lineCount + 2);
+    for (std::size_t i = 0; i < queryCount; ++i)
+    {
+        auto line = (queryCount == maxQueries) ? static_cast<int>(1 + random() % (lineCount + 1)) : static_cast<int>(i + 1);
+        switch (random() % 8)
+        {
+        case 0:
+            queries += (useStdin ? "-"s : filePath) + ":" + std::to_string(line);
+            addQuery(line, expected);
+            break;
+        case 1:
+            queries += "other.h:" + std::to_string(line);
+            break;
+        default:
+            queries += std::to_string(line);
+            addQuery(line, expected);
+            break;
+        }
+        queries += (random() % 4) ? "\n" : " ";
+    }
+
+    auto queriesPath = (context.directory / (name + ".queries")).string();
+    write_text_file(queriesPath, queries);
+
+    // Byte offsets into the file as stored, including offsets that fall inside the byte order mark and inside
+    // multi-byte characters, all of which resolve to the line containing the character
+    std::string offsetArguments;
+    auto addOffset = [&](std::size_t offset, int line) {
+        offsetArguments += " " + std::to_string(offset);
+        snprintf(buffer, sizeof(buffer),
+            "Requirements for byte offset %zu (line %d) being included in the translation unit:\n", offset, line);
+        expected += buffer;
+        reference_query(line, conditionals, expected);
+        expected += '\n';
+    };
+
+    std::size_t bomSize = (enc == encoding::utf8) ? 0 : (enc == encoding::utf8_bom) ? 3 : 2;
+    if (bomSize > 0)
+    {
+        addOffset(random() % bomSize, 1);
+    }
+
+    std::vector<std::size_t> positions;
+    for (int i = 0; (i < 40) && !text.empty(); ++i)
+    {
+        positions.push_back(random() % text.size());
+    }
+    std::sort(positions.begin(), positions.end());
+
+    std::size_t pos = 0;
+    std::size_t offset = bomSize;
+    int line = 1;
+    for (auto target : positions)
+    {
+        for (; pos + utf8_sequence_length(text[pos]) <= target; pos += utf8_sequence_length(text[pos]))
+        {
+            offset += encoded_length(text, pos, enc);
+            line += (text[pos] == '\n') ? 1 : 0;
+        }
+        addOffset(offset + random() % encoded_length(text, pos, enc), line);
+    }
+
+    std::string output;
+    auto arguments = "--file " + quote(fileArgument) + " --lines-from " + quote(queriesPath) + " --offsets" + offsetArguments;
+    auto succeeded = run_tool(context, arguments, input, output);
+    check(context, name, arguments, error.empty(), error.empty() ? expected : error, output, succeeded);
+
+    // A handful of lines given on the command line, which is too few for the dense lookup table to be worth building
+    std::string lines;
+    expected.clear();
+    for (int i = 0; i < 8; ++i)
+    {
+        auto line = static_cast<int>(1 + random() % (lineCount + 1));
+        lines += " " + std::to_string(line);
+        addQuery(line, expected);
+    }
+
+    arguments = "--file " + quote(fileArgument) + " --lines" + lines;
+    succeeded = run_tool(context, arguments, input, output);
+    check(context, name, arguments, error.empty(), error.empty() ? expected : error, output, succeeded);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: differential_test <path to when_present> <working directory>\n");
+        return 1;
+    }
+
+    test_context context;
+    context.tool = argv[1];
+    context.directory = argv[2];
+    std::filesystem::create_directories(context.directory);
+
+    // Many small files cover the combinations of directives, spacing and line endings
+    static constexpr line_endings allEndings[] = { line_endings::lf, line_endings::crlf, line_endings::mixed };
+    for (std::uint32_t seed = 1; seed <= 30; ++seed)
+    {
+        generator_options options;
+        options.endings = allEndings[seed % std::size(allEndings)];
+        options.size = 512 + (seed * 337) % 8192;
+        run_case(context, "small_" + std::to_string(seed), source_generator(seed, options).generate(), encoding::utf8,
+            seed, 100000);
+    }
+
+    {
+        generator_options options;
+        options.chain_depth = 300;
+        options.max_depth = 20;
+        options.size = 64 * 1024;
+        run_case(context, "deep", source_generator(100, options).generate(), encoding::utf8, 100, 100000);
+    }
+
+    {
+        generator_options options;
+        options.continuation_length = 40;
+        options.size = 64 * 1024;
+        options.endings = line_endings::mixed;
+        run_case(context, "continuations", source_generator(101, options).generate(), encoding::utf8, 101, 100000);
+    }
+
+    {
+        generator_options options;
+        options.top_level_siblings = 3000;
+        options.nested_siblings = 700;
+        options.size = 256 * 1024;
+        run_case(context, "wide", source_generator(102, options).generate(), encoding::utf8, 102, 100000);
+    }
+
+    {
+        generator_options options;
+        options.non_ascii = true;
+        options.endings = line_endings::crlf;
+        options.size = 128 * 1024;
+        auto text = source_generator(103, options).generate();
+        run_case(context, "utf8", text, encoding::utf8, 103, 100000);
+        run_case(context, "utf8_bom", text, encoding::utf8_bom, 104, 100000);
+        run_case(context, "utf16le", text, encoding::utf16le, 105, 100000);
+        run_case(context, "utf16be", text, encoding::utf16be, 106, 100000);
+        run_case(context, "stdin", text, encoding::utf16le, 107, 100000, true);
+    }
+
+    {
+        // Large enough to be scanned in parallel chunks on machines with more than one hardware thread
+        generator_options options;
+        options.size = 10 * 1024 * 1024;
+        options.endings = line_endings::mixed;
+        run_case(context, "large", source_generator(108, options).generate(), encoding::utf8, 108, 2000);
+    }
+
+    {
+        // Files that do not form a valid tree
+        run_case(context, "unbalanced_else", "int a;\n#else\n#endif\n", encoding::utf8, 109, 10);
+        run_case(context, "unbalanced_endif", "#if A\n#endif\n#endif\n", encoding::utf8, 110, 10);
+        run_case(context, "unterminated", "#if A\n#ifdef B\n#endif\n", encoding::utf8, 111, 10);
+    }
+
+    printf("%d cases, %d of %d runs passed\n", context.cases, context.runs - context.failures, context.runs);
+    return (context.failures == 0) ? 0 : 1;
+}
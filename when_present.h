@@ -0,0 +1,459 @@
+// The directive scanner, along with a fixed capacity index that can be built and queried in constant expressions. This
+// is everything needed to answer presence queries at compile time, e.g. so that a code generator can check the
+// conditions that a line of a snippet it emits depends on with a static_assert. See main.cpp for the runtime index, which
+// is built from the same directive stream
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+
+// Counts the bytes the scanner examines. The complexity fuzz target in main.cpp defines this to check that scanning stays
+// linear in the size of the input
+#ifndef WHEN_PRESENT_COUNT_SCANNED
+#define WHEN_PRESENT_COUNT_SCANNED(bytes)
+#endif
+
+inline constexpr const char whitespace[] = " \t\v";
+
+// Every standard preprocessor directive, along with the common '#include_next' extension
+enum class directive_kind : std::uint8_t
+{
+    if_,
+    ifdef,
+    ifndef,
+    elif,
+    elifdef,
+    elifndef,
+    else_,
+    endif,
+    define,
+    undef,
+    include,
+    include_next,
+    embed,
+    line,
+    error,
+    warning,
+    pragma,
+    unknown, // Anything else, e.g. a compiler specific directive or a line marker
+};
+
+// How a directive affects the shape of the conditional tree
+enum class conditional_role
+{
+    none,
+    begin,       // '#if', '#ifdef', '#ifndef'
+    alternative, // '#elif', '#elifdef', '#elifndef', '#else'
+    end,         // '#endif'
+};
+
+constexpr conditional_role role_of(directive_kind kind)
+{
+    switch (kind)
+    {
+    case directive_kind::if_:
+    case directive_kind::ifdef:
+    case directive_kind::ifndef:
+        return conditional_role::begin;
+
+    case directive_kind::elif:
+    case directive_kind::elifdef:
+    case directive_kind::elifndef:
+    case directive_kind::else_:
+        return conditional_role::alternative;
+
+    case directive_kind::endif:
+        return conditional_role::end;
+
+    default:
+        return conditional_role::none;
+    }
+}
+
+struct directive_name
+{
+    std::string_view name;
+    directive_kind kind = directive_kind::unknown;
+};
+
+inline constexpr directive_name directive_names[] = {
+    { "if", directive_kind::if_ },
+    { "ifdef", directive_kind::ifdef },
+    { "ifndef", directive_kind::ifndef },
+    { "elif", directive_kind::elif },
+    { "elifdef", directive_kind::elifdef },
+    { "elifndef", directive_kind::elifndef },
+    { "else", directive_kind::else_ },
+    { "endif", directive_kind::endif },
+    { "define", directive_kind::define },
+    { "undef", directive_kind::undef },
+    { "include", directive_kind::include },
+    { "include_next", directive_kind::include_next },
+    { "embed", directive_kind::embed },
+    { "line", directive_kind::line },
+    { "error", directive_kind::error },
+    { "warning", directive_kind::warning },
+    { "pragma", directive_kind::pragma },
+};
+
+// A perfect hash over the (non-empty) names in 'directive_names', so that identifying a directive takes a single
+// comparison rather than a chain of them. The static_assert below verifies that no two names share a slot
+inline constexpr std::size_t directive_table_size = 32;
+
+constexpr std::size_t directive_hash(std::string_view name)
+{
+    return (static_cast<unsigned char>(name.front()) + static_cast<unsigned char>(name.back()) + 7 * name.size()) %
+        directive_table_size;
+}
+
+inline constexpr auto directive_table = [] {
+    std::array<directive_name, directive_table_size> table{};
+    for (auto& entry : directive_names)
+    {
+        table[directive_hash(entry.name)] = entry;
+    }
+    return table;
+}();
+
+static_assert(
+    [] {
+        for (auto& entry : directive_names)
+        {
+            if (directive_table[directive_hash(entry.name)].name != entry.name)
+            {
+                return false;
+            }
+        }
+        return true;
+    }(),
+    "Directive names must not collide in 'directive_table'");
+
+constexpr directive_kind lookup_directive(std::string_view name)
+{
+    if (name.empty())
+    {
+        return directive_kind::unknown;
+    }
+
+    auto& entry = directive_table[directive_hash(name)];
+    return (entry.name == name) ? entry.kind : directive_kind::unknown;
+}
+
+struct directive
+{
+    int line;
+    directive_kind kind;
+    std::string_view text; // The full text of the directive, including any continuation lines
+};
+
+// A condition that must have a particular value for a line to be present
+struct requirement
+{
+    bool value = false; // Whether the condition must be true or false
+    int line = 0; // The location of the directive
+    std::string_view condition;
+};
+
+constexpr bool operator==(const requirement& lhs, const requirement& rhs)
+{
+    return (lhs.value == rhs.value) && (lhs.line == rhs.line) && (lhs.condition == rhs.condition);
+}
+
+constexpr bool operator!=(const requirement& lhs, const requirement& rhs)
+{
+    return !(lhs == rhs);
+}
+
+// Line ending policies for the scanner. 'crlf_line_endings' checks each line for a '\r' before its newline, so it handles
+// LF, CRLF and mixed files alike. 'lf_line_endings' is only for text that is known not to contain CRLF line endings
+struct lf_line_endings
+{
+    // Returns the end of the content of the line terminated by the newline at 'newlinePos'
+    static constexpr std::size_t content_end(std::string_view, std::size_t newlinePos)
+    {
+        return newlinePos;
+    }
+};
+
+struct crlf_line_endings
+{
+    static constexpr std::size_t content_end(std::string_view text, std::size_t newlinePos)
+    {
+        return ((newlinePos > 0) && (text[newlinePos - 1] == '\r')) ? (newlinePos - 1) : newlinePos;
+    }
+};
+
+// Returns true if the newline at 'newlinePos' is escaped, i.e. the line it terminates ends with '\' and is therefore
+// continued on the next line
+template <typename LineEndings>
+constexpr bool is_line_continuation(std::string_view text, std::size_t newlinePos)
+{
+    auto pos = LineEndings::content_end(text, newlinePos);
+    return (pos > 0) && (text[pos - 1] == '\\');
+}
+
+constexpr bool is_directive_name_char(char ch)
+{
+    return ((ch >= 'a') && (ch <= 'z')) || ((ch >= 'A') && (ch <= 'Z')) || (ch == '_');
+}
+
+constexpr bool classify_directive(std::string_view line, directive_kind& kind)
+{
+    // Leading whitespace is ignored
+    auto pos = line.find_first_not_of(whitespace);
+    if (pos == line.npos)
+    {
+        WHEN_PRESENT_COUNT_SCANNED(line.length());
+        return false;
+    }
+
+    // Preprocessor directives must be first (e.g. cannot be after any other statement)
+    if (line[pos] != '#')
+    {
+        WHEN_PRESENT_COUNT_SCANNED(pos + 1);
+        return false;
+    }
+
+    // There can be space after the '#', e.g. "#   if ..."
+    pos = line.find_first_not_of(whitespace, pos + 1);
+    if (pos == line.npos)
+    {
+        // This is ill-formed, but ignore...
+        WHEN_PRESENT_COUNT_SCANNED(line.length());
+        return false;
+    }
+
+    // Determine which directive this is
+    auto endPos = pos;
+    for (; endPos < line.length(); ++endPos)
+    {
+        if (!is_directive_name_char(line[endPos]))
+        {
+            break;
+        }
+    }
+
+    WHEN_PRESENT_COUNT_SCANNED(endPos);
+    kind = lookup_directive(line.substr(pos, endPos - pos));
+    return true;
+}
+
+// Scans a range of whole lines for directives, passing each to 'sink'. The position of each newline character
+// is passed to 'newlineSink'. Line numbers are relative to the start of the range, i.e. the first line in the range is
+// line 1. Returns the number of newline characters in the range. This is usable in constant expressions, e.g. to check
+// the conditions in an embedded snippet with a static_assert
+template <typename LineEndings, typename Sink, typename NewlineSink>
+constexpr int scan_chunk(std::string_view text, Sink&& sink, NewlineSink&& newlineSink)
+{
+    int currentLineNumber = 1;
+    std::size_t pos = 0;
+    while (pos < text.size())
+    {
+        auto lineNumber = currentLineNumber;
+        auto lineBegin = pos;
+        auto lineEnd = pos;
+
+        // Lines that end with '\' get appended with the next line. This may have valuable information if the next line
+        // is part of a preprocessor condition, so merge the two
+        while (true)
+        {
+            auto newlinePos = text.find('\n', pos);
+            if (newlinePos == text.npos)
+            {
+                WHEN_PRESENT_COUNT_SCANNED(text.size() - pos);
+                lineEnd = pos = text.size();
+                break;
+            }
+
+            WHEN_PRESENT_COUNT_SCANNED(newlinePos - pos + 1);
+            newlineSink(newlinePos);
+            lineEnd = LineEndings::content_end(text, newlinePos);
+            pos = newlinePos + 1;
+            ++currentLineNumber;
+            if (!is_line_continuation<LineEndings>(text, newlinePos))
+            {
+                break;
+            }
+        }
+
+        auto line = text.substr(lineBegin, lineEnd - lineBegin);
+        directive_kind kind{};
+        if (classify_directive(line, kind))
+        {
+            sink(directive{ lineNumber, kind, line });
+        }
+    }
+
+    return currentLineNumber - 1;
+}
+
+static_assert(
+    [] {
+        constexpr std::string_view snippet = "#if A\nint a;\n  #  elif B \\\n  && C\n#else\n#include_next <a.h>\n#endif";
+        constexpr directive expected[] = { { 1, directive_kind::if_, snippet.substr(0, 5) },
+            { 3, directive_kind::elif, snippet.substr(13, 20) }, { 5, directive_kind::else_, "#else" },
+            { 6, directive_kind::include_next, "#include_next <a.h>" }, { 7, directive_kind::endif, "#endif" } };
+
+        std::size_t count = 0;
+        std::size_t lastNewline = 0;
+        bool matches = true;
+        auto lineCount = scan_chunk<lf_line_endings>(
+            snippet,
+            [&](const directive& dir) {
+                matches = matches && (count < std::size(expected)) && (dir.line == expected[count].line) &&
+                    (dir.kind == expected[count].kind) && (dir.text == expected[count].text);
+                ++count;
+            },
+            [&](std::size_t pos) { lastNewline = pos; });
+        return matches && (count == std::size(expected)) && (lineCount == 6) && (lastNewline == snippet.size() - 7);
+    }(),
+    "The directive scanner must be usable in constant expressions");
+
+// A fixed capacity list, for use in constant expressions where memory cannot be allocated
+template <typename T, std::size_t Capacity>
+struct static_vector
+{
+    static_assert(Capacity > 0);
+
+    constexpr void push_back(const T& value)
+    {
+        items[count++] = value;
+    }
+
+    constexpr void resize(std::size_t size)
+    {
+        count = size;
+    }
+
+    constexpr const T& operator[](std::size_t index) const
+    {
+        return items[index];
+    }
+
+    constexpr std::size_t size() const
+    {
+        return count;
+    }
+
+    constexpr const T* begin() const
+    {
+        return items;
+    }
+
+    constexpr const T* end() const
+    {
+        return items + count;
+    }
+
+    T items[Capacity] = {};
+    std::size_t count = 0;
+};
+
+// An index that can be built and queried in constant expressions. E.g.:
+//      constexpr static_conditional_index<16> index(snippet);
+//      static_assert(index.valid && (index.query(42)[0] == requirement{ true, 3, "#ifdef _WIN32" }));
+// Holds at most 'MaxDirectives' conditional directives; any more, or directives that do not nest, leave the index
+// invalid. Rather than building a tree, a query replays the directives that come before the line, which gives the same
+// results as the runtime index but is only suited to the small inputs that constant evaluation can handle anyway. Both
+// LF and CRLF line endings are accepted
+template <std::size_t MaxDirectives>
+struct static_conditional_index
+{
+    constexpr explicit static_conditional_index(std::string_view text)
+    {
+        int depth = 0;
+        scan_chunk<crlf_line_endings>(
+            text,
+            [&](const directive& dir) {
+                auto role = role_of(dir.kind);
+                if ((role == conditional_role::none) || !valid)
+                {
+                    return;
+                }
+
+                if ((directives.size() == MaxDirectives) || ((role != conditional_role::begin) && (depth == 0)))
+                {
+                    valid = false;
+                    return;
+                }
+
+                depth += (role == conditional_role::begin) ? 1 : (role == conditional_role::end) ? -1 : 0;
+                directives.push_back(dir);
+            },
+            [](std::size_t) {});
+
+        valid = valid && (depth == 0);
+    }
+
+    // Returns the requirements for 'line' to be present, outermost first
+    constexpr static_vector<requirement, MaxDirectives> query(int line) const
+    {
+        // The blocks seen so far of each conditional that is open at 'line', as indices into 'directives', along with
+        // where each conditional's blocks start in that list
+        static_vector<std::size_t, MaxDirectives> blocks;
+        static_vector<std::size_t, MaxDirectives> conditionals;
+        bool onEndif = false;
+        for (std::size_t i = 0; (i < directives.size()) && (directives[i].line <= line); ++i)
+        {
+            auto role = role_of(directives[i].kind);
+            if (role == conditional_role::begin)
+            {
+                conditionals.push_back(blocks.size());
+                blocks.push_back(i);
+            }
+            else if (role == conditional_role::alternative)
+            {
+                blocks.push_back(i);
+            }
+            else if (directives[i].line == line)
+            {
+                // The line is the '#endif' itself, which no block contains
+                onEndif = true;
+                break;
+            }
+            else
+            {
+                blocks.resize(conditionals[conditionals.size() - 1]);
+                conditionals.resize(conditionals.size() - 1);
+            }
+        }
+
+        // The last block of each open conditional contains the line, and all before it must have been false
+        static_vector<requirement, MaxDirectives> result;
+        for (std::size_t i = 0; i < conditionals.size(); ++i)
+        {
+            auto innermost = (i + 1 == conditionals.size());
+            auto end = innermost ? blocks.size() : conditionals[i + 1];
+            for (auto block = conditionals[i]; block < end; ++block)
+            {
+                auto& dir = directives[blocks[block]];
+                result.push_back(requirement{ (block + 1 == end) && !(innermost && onEndif), dir.line, dir.text });
+            }
+        }
+
+        return result;
+    }
+
+    static_vector<directive, MaxDirectives> directives; // Only those that affect the shape of the tree
+    bool valid = true;
+};
+
+static_assert(
+    [] {
+        constexpr std::string_view snippet =
+            "#ifdef _WIN32\r\n#if A\r\nint a;\r\n#elif B\r\nint b;\r\n#endif\r\n#else\r\nint c;\r\n#endif\r\n";
+        static_conditional_index<8> index(snippet);
+        auto b = index.query(5);
+        auto c = index.query(8);
+        auto endif = index.query(6);
+        return index.valid && (b.size() == 3) && (b[0] == requirement{ true, 1, "#ifdef _WIN32" }) &&
+            (b[1] == requirement{ false, 2, "#if A" }) && (b[2] == requirement{ true, 4, "#elif B" }) &&
+            (c.size() == 2) && (c[0] == requirement{ false, 1, "#ifdef _WIN32" }) &&
+            (c[1] == requirement{ true, 7, "#else" }) && (endif.size() == 3) &&
+            (endif[2] == requirement{ false, 4, "#elif B" }) && (index.query(10).size() == 0) &&
+            !static_conditional_index<8>("#endif\n#if A\n").valid;
+    }(),
+    "Presence queries must be usable in constant expressions");